@@ -112,7 +112,13 @@ really gives us our awesome performance.
 *******************************************************************************/
 
 # define PY_SSIZE_T_CLEAN
+# define AUTOMAP_MODULE
 # include "Python.h"
+# include "automap.h"
+
+# ifdef __linux__
+# include <sys/mman.h>
+# endif
 
 // PyPy doesn't define Py_UNREACHABLE():
 
@@ -124,6 +130,64 @@ really gives us our awesome performance.
 
 # define LOAD 0.9
 # define SCAN 16
+# define BATCH 16
+
+// How many pilots to try for each bucket of an optimized map before giving up:
+
+# define PILOTS (1 << 16)
+
+// Tables start on a cache line boundary, so that a SCAN window never straddles
+// more cache lines than it needs to:
+
+# define ALIGNMENT 64
+
+// Not every compiler lets us ask for a cache line ahead of time:
+
+# if defined(__GNUC__) || defined(__clang__)
+# define PREFETCH(p) __builtin_prefetch((p))
+# elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+# include <xmmintrin.h>
+# define PREFETCH(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+# else
+# define PREFETCH(p)
+# endif
+
+// The Arrow C Data Interface, verbatim from the spec. It's ABI-stable, so we
+// don't need Arrow itself to read arrays that are handed to us:
+
+# ifndef ARROW_C_DATA_INTERFACE
+# define ARROW_C_DATA_INTERFACE
+
+# define ARROW_FLAG_DICTIONARY_ORDERED 1
+# define ARROW_FLAG_NULLABLE 2
+# define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray *);
+    void *private_data;
+};
+
+# endif
 
 
 typedef struct {
@@ -136,7 +200,28 @@ typedef struct {
     PyObject_VAR_HEAD
     Py_ssize_t tablesize;
     entry *table;
+    Py_ssize_t *tablerefs;
     PyObject *keys;
+    Py_ssize_t keys_size;
+    // Maps built from Arrow strings have no keys list. Instead, they hold on to
+    // the capsule that owns the Arrow buffers, and read the keys from those:
+    PyObject *strings;
+    const void *offsets;
+    const char *data;
+    int large;
+    // Optimized maps replace the table with a minimal perfect hash: one pilot
+    // per bucket of keys, and exactly one slot per key (see optimize()):
+    uint16_t *pilots;
+    Py_ssize_t buckets;
+    // Sorted maps have no table or keys list, just their (strictly increasing)
+    // integer keys, which are binary searched:
+    int64_t *sorted;
+    // Maps constructed with bloom=True keep a blocked Bloom filter of their
+    // hashes (one 512-bit block per 64 table slots), so that most misses never
+    // touch the table. Snapshots don't get one.
+    int filtered;
+    uint64_t *filter;
+    Py_ssize_t filterblocks;
 } FAMObject;
 
 
@@ -160,6 +245,7 @@ typedef struct {
     Kind kind;
     int reversed;
     Py_ssize_t index;
+    PyObject *result;
 } FAMIObject;
 
 
@@ -174,10 +260,61 @@ static PyObject *intcache = NULL;
 static Py_ssize_t count = 0;
 
 
+static AutoMapAllocator allocator = {NULL, NULL, NULL};
+static PyObject *allocator_capsule = NULL;
+
+// Tables at least this many bytes are backed by transparent huge pages, where
+// available. A negative value means never:
+
+static Py_ssize_t huge_page_threshold = 1 << 21;
+
+// Arrow strings are hashed with our own function, seeded from str's hash so
+// that they're randomized the same way:
+
+static uint64_t string_seed = 0;
+
+
+static const char *
+string_at(FAMObject *self, Py_ssize_t index, Py_ssize_t *size)
+{
+    int64_t start, stop;
+    if (self->large) {
+        start = ((const int64_t *)self->offsets)[index];
+        stop = ((const int64_t *)self->offsets)[index + 1];
+    }
+    else {
+        start = ((const int32_t *)self->offsets)[index];
+        stop = ((const int32_t *)self->offsets)[index + 1];
+    }
+    *size = (Py_ssize_t)(stop - start);
+    return self->data + start;
+}
+
+
+static PyObject *
+key_at(FAMObject *self, Py_ssize_t index)
+{
+    // Return a new reference to a key. For Arrow strings and sorted maps, this
+    // is the only place key objects get created:
+    if (self->strings) {
+        Py_ssize_t size;
+        const char *data = string_at(self, index, &size);
+        return PyUnicode_DecodeUTF8(data, size, NULL);
+    }
+    if (self->sorted) {
+        return PyLong_FromLongLong(self->sorted[index]);
+    }
+    PyObject *key = PyList_GET_ITEM(self->keys, index);
+    Py_INCREF(key);
+    return key;
+}
+
+
 static void
 fami_dealloc(FAMIObject *self)
 {
     Py_DECREF(self->map);
+    Py_XDECREF(self->result);
     Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -195,7 +332,7 @@ fami_iternext(FAMIObject *self)
 {
     Py_ssize_t index;
     if (self->reversed) {
-        index = PyList_GET_SIZE(self->map->keys) - ++self->index;
+        index = self->map->keys_size - ++self->index;
         if (index < 0) {
             return NULL;
         }
@@ -203,21 +340,45 @@ fami_iternext(FAMIObject *self)
     else {
         index = self->index++;
     }
-    if (PyList_GET_SIZE(self->map->keys) <= index) {
+    if (self->map->keys_size <= index) {
         return NULL;
     }
     switch (self->kind) {
         case ITEMS: {
-            return PyTuple_Pack(
-                2,
-                PyList_GET_ITEM(self->map->keys, index),
-                PyList_GET_ITEM(intcache, index)
-            );
+            PyObject *key = key_at(self->map, index);
+            if (!key) {
+                return NULL;
+            }
+            PyObject *value = PyList_GET_ITEM(intcache, index);
+# ifndef PYPY_VERSION
+            // Like dict's item iterators, reuse our last result if nobody else
+            // is holding on to it:
+            PyObject *result = self->result;
+            if (result && Py_REFCNT(result) == 1) {
+                PyObject *oldkey = PyTuple_GET_ITEM(result, 0);
+                PyObject *oldvalue = PyTuple_GET_ITEM(result, 1);
+                Py_INCREF(value);
+                PyTuple_SET_ITEM(result, 0, key);
+                PyTuple_SET_ITEM(result, 1, value);
+                Py_DECREF(oldkey);
+                Py_DECREF(oldvalue);
+#   if PY_VERSION_HEX >= 0x03090000
+                // The GC may have untracked the tuple since its last use, but
+                // the new key could be part of a cycle:
+                if (!PyObject_GC_IsTracked(result)) {
+                    PyObject_GC_Track(result);
+                }
+#   endif
+                Py_INCREF(result);
+                return result;
+            }
+# endif
+            PyObject *yield = PyTuple_Pack(2, key, value);
+            Py_DECREF(key);
+            return yield;
         }
         case KEYS: {
-            PyObject *yield = PyList_GET_ITEM(self->map->keys, index);
-            Py_INCREF(yield);
-            return yield;
+            return key_at(self->map, index);
         }
         case VALUES: {
             PyObject *yield = PyList_GET_ITEM(intcache, index);
@@ -232,7 +393,7 @@ fami_iternext(FAMIObject *self)
 static PyObject *
 fami___length_hint__(FAMIObject *self)
 {
-    Py_ssize_t len = Py_MAX(0, PyList_GET_SIZE(self->map->keys) - self->index);
+    Py_ssize_t len = Py_MAX(0, self->map->keys_size - self->index);
     return PyLong_FromSsize_t(len);
 }
 
@@ -277,6 +438,14 @@ iter(FAMObject *map, Kind kind, int reversed)
     self->kind = kind;
     self->reversed = reversed;
     self->index = 0;
+    self->result = NULL;
+    if (kind == ITEMS) {
+        self->result = PyTuple_Pack(2, Py_None, Py_None);
+        if (!self->result) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
     return (PyObject *)self;
 }
 
@@ -329,6 +498,18 @@ famv_contains(FAMVObject *self, PyObject *other)
     if (self->kind == KEYS) {
         return fam_contains(self->map, other);
     }
+    if (self->kind == VALUES && PyLong_Check(other)) {
+        // Our values are always range(len(map)):
+        Py_ssize_t value = PyLong_AsSsize_t(other);
+        if (value == -1 && PyErr_Occurred()) {
+            if (!PyErr_ExceptionMatches(PyExc_OverflowError)) {
+                return -1;
+            }
+            PyErr_Clear();
+            return 0;
+        }
+        return 0 <= value && value < self->map->keys_size;
+    }
     PyObject *iterator = famv_iter(self);
     if (!iterator) {
         return -1;
@@ -344,6 +525,66 @@ static PySequenceMethods famv_as_sequence = {
 };
 
 
+static int
+famv_getbuffer(FAMVObject *self, Py_buffer *view, int flags)
+{
+    // Only values() can be exported, as a read-only buffer of int64. It's
+    // materialized lazily for each export, since the map can grow in between.
+    view->obj = NULL;
+    if (self->kind != VALUES) {
+        PyErr_SetString(PyExc_BufferError,
+                        "only values() supports the buffer protocol");
+        return -1;
+    }
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "values() is not writable");
+        return -1;
+    }
+    Py_ssize_t size = self->map->keys_size;
+    // The first two items hold the shape and strides, so that they live as
+    // long as the export (the view itself may be copied, as memoryview does):
+    int64_t *block = PyMem_New(int64_t, size + 2);
+    if (!block) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    Py_ssize_t *shape = (Py_ssize_t *)block;
+    *shape = size;
+    Py_ssize_t *strides = (Py_ssize_t *)(block + 1);
+    *strides = sizeof(int64_t);
+    int64_t *values = block + 2;
+    for (Py_ssize_t index = 0; index < size; index++) {
+        values[index] = index;
+    }
+    Py_INCREF(self);
+    view->obj = (PyObject *)self;
+    view->buf = values;
+    view->internal = block;
+    view->len = size * sizeof(int64_t);
+    view->readonly = 1;
+    view->itemsize = sizeof(int64_t);
+    view->format = (flags & PyBUF_FORMAT) ? "q" : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) ? strides : NULL;
+    view->suboffsets = NULL;
+    return 0;
+}
+
+
+static void
+famv_releasebuffer(FAMVObject *self, Py_buffer *view)
+{
+    PyMem_Free(view->internal);
+}
+
+
+static PyBufferProcs famv_as_buffer = {
+    .bf_getbuffer = (getbufferproc) famv_getbuffer,
+    .bf_releasebuffer = (releasebufferproc) famv_releasebuffer,
+};
+
+
 static void
 famv_dealloc(FAMVObject *self)
 {
@@ -362,7 +603,7 @@ famv_iter(FAMVObject *self)
 static PyObject *
 famv___length_hint__(FAMVObject *self)
 {
-    return PyLong_FromSsize_t(PyList_GET_SIZE(self->map->keys));
+    return PyLong_FromSsize_t(self->map->keys_size);
 }
 
 
@@ -415,6 +656,7 @@ famv_richcompare(FAMVObject *self, PyObject *other, int op)
 
 static PyTypeObject FAMVType = {
     PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_as_buffer = &famv_as_buffer,
     .tp_as_number = &famv_as_number,
     .tp_as_sequence = &famv_as_sequence,
     .tp_basicsize = sizeof(FAMVObject),
@@ -440,13 +682,129 @@ view(FAMObject *map, int kind)
 }
 
 
+static uint64_t
+mix(uint64_t hash)
+{
+    // MurmurHash3's 64-bit finalizer:
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+
 static Py_ssize_t
-lookup_hash(FAMObject *self, PyObject *key, Py_hash_t hash)
+reduce(uint64_t hash, Py_ssize_t size)
 {
-    entry *table = self->table;
-    Py_ssize_t mask = self->tablesize - 1;
+    // Map 32 bits of hash onto [0, size) without a division:
+    return (Py_ssize_t)(((hash & 0xFFFFFFFF) * (uint64_t)size) >> 32);
+}
+
+
+// Optimized maps mix each hash once. The high half picks its bucket, and the
+// low half (scrambled by the bucket's pilot) picks its slot:
+
+static Py_ssize_t
+perfect_bucket(uint64_t mixed, Py_ssize_t buckets)
+{
+    return reduce(mixed >> 32, buckets);
+}
+
+
+static Py_ssize_t
+perfect_slot(uint64_t mixed, uint16_t pilot, Py_ssize_t size)
+{
+    // XOR alone would keep any two keys' slots tied together for every pilot,
+    // so multiply too:
+    uint64_t scrambled = (mixed ^ (pilot * 0x9E3779B97F4A7C15ULL)) *
+                         0xC4CEB9FE1A85EC53ULL;
+    return reduce(scrambled >> 32, size);
+}
+
+
+static Py_ssize_t
+lookup_perfect(FAMObject *self, Py_hash_t hash)
+{
+    // Optimized maps have exactly one place each key can be. The table has an
+    // extra empty slot past the end, which we return for anything else:
+    uint64_t mixed = mix(hash);
+    Py_ssize_t index = perfect_slot(
+        mixed, self->pilots[perfect_bucket(mixed, self->buckets)],
+        self->tablesize);
+    return self->table[index].hash == hash ? index : self->tablesize;
+}
+
+
+// Each key sets one bit in each of the eight words of its block, chosen by
+// multiplying its (mixed) hash by these odd constants, as in Parquet's split
+// block Bloom filters. A block is exactly one (aligned) cache line:
+
+# define FILTER_WORDS 8
+# define FILTER_BLOCK (FILTER_WORDS * sizeof(uint64_t))
+
+static const uint32_t filter_salts[FILTER_WORDS] = {
+    0x47B6137BU, 0x44974D91U, 0x8824AD5BU, 0xA2B7289DU,
+    0x705495C7U, 0x2DF1424BU, 0x9EFC4947U, 0x5C6BFB31U,
+};
+
+
+static uint64_t *
+filter_block(FAMObject *self, uint64_t mixed)
+{
+    return self->filter +
+           FILTER_WORDS * ((mixed >> 32) & (self->filterblocks - 1));
+}
+
+
+static void
+filter_add(FAMObject *self, Py_hash_t hash)
+{
+    uint64_t mixed = mix(hash);
+    uint64_t *block = filter_block(self, mixed);
+    for (int i = 0; i < FILTER_WORDS; i++) {
+        block[i] |= 1ULL << (((uint32_t)mixed * filter_salts[i]) >> 26);
+    }
+}
+
+
+static int
+filter_check(FAMObject *self, Py_hash_t hash)
+{
+    // Return 0 if hash is definitely not one of ours. This is branch-free, so
+    // the compiler is free to vectorize it:
+    uint64_t mixed = mix(hash);
+    uint64_t *block = filter_block(self, mixed);
+    uint64_t missing = 0;
+    for (int i = 0; i < FILTER_WORDS; i++) {
+        missing |= ~block[i] &
+                   (1ULL << (((uint32_t)mixed * filter_salts[i]) >> 26));
+    }
+    return !missing;
+}
+
+
+// Every table is probed the same way: SCAN slots of linear probing, then a
+// jump perturbed by the hash's upper bits, until we find a match or an empty
+// slot. Only how a stored key is compared to the one we're looking for
+// differs between maps, so that's passed in: match() returns 1 if the key at
+// the given offset matches, 0 if it doesn't, and -1 on error. Since probe() is
+// inline and each caller passes a constant match(), the call is made directly.
+// match() may also return RESTART if the table changed while it ran, in which
+// case the caller has to start over on the new one.
+
+# define RESTART -2
+
+typedef int (*matcher)(const void *context, Py_ssize_t offset);
+
+
+static inline Py_ssize_t
+probe(const entry *table, Py_ssize_t tablesize, Py_hash_t hash,
+      matcher match, const void *context)
+{
+    Py_ssize_t mask = tablesize - 1;
     Py_hash_t mixin = Py_ABS(hash);
-    PyObject **items = PySequence_Fast_ITEMS(self->keys);
     Py_ssize_t index = hash & mask;
     while (1) {
         for (Py_ssize_t i = 0; i < SCAN; i++) {
@@ -455,25 +813,18 @@ lookup_hash(FAMObject *self, PyObject *key, Py_hash_t hash)
                 // Miss.
                 return index;
             }
-            if (h != hash) {
-                // Collision.
-                index++;
-                continue;
-            }
-            PyObject *guess = items[table[index].index];
-            if (guess == key) {
-                // Hit.
-                return index;
-            }
-            int result = PyObject_RichCompareBool(guess, key, Py_EQ);
-            if (result < 0) {
-                // Error.
-                return -1;
-            }
-            if (result) {
-                // Hit.
-                return index;
+            if (h == hash) {
+                int result = match(context, table[index].index);
+                if (result < 0) {
+                    // Error (or RESTART).
+                    return result;
+                }
+                if (result) {
+                    // Hit.
+                    return index;
+                }
             }
+            // Collision.
             index++;
         }
         index = (5 * (index - SCAN) + (mixin >>= 1) + 1) & mask;
@@ -481,256 +832,2477 @@ lookup_hash(FAMObject *self, PyObject *key, Py_hash_t hash)
 }
 
 
-static Py_ssize_t
-lookup(FAMObject *self, PyObject *key) {
-    Py_hash_t hash = PyObject_Hash(key);
-    if (hash == -1) {
-        return -1;
-    }
-    Py_ssize_t index = lookup_hash(self, key, hash);
-    if ((index < 0) || (self->table[index].hash == -1)) {
-        return -1;
-    }
-    return self->table[index].index;
-}
+typedef struct {
+    FAMObject *self;
+    PyObject *key;
+} objectkey;
+
+
+static void release(entry *, Py_ssize_t *);
 
 
 static int
-insert(FAMObject *self, PyObject *key, Py_ssize_t offset, Py_hash_t hash)
+pin(FAMObject *self)
 {
-    if (hash == -1) {
-        hash = PyObject_Hash(key);
-        if (hash == -1) {
+    // Take a reference to our current table, like a snapshot does, so that it
+    // outlives any growth until it's passed to release():
+    if (!self->tablerefs) {
+        self->tablerefs = PyMem_New(Py_ssize_t, 1);
+        if (!self->tablerefs) {
+            PyErr_NoMemory();
             return -1;
         }
+        *self->tablerefs = 1;
     }
-    Py_ssize_t index = lookup_hash(self, key, hash);
-    if (index < 0) {
-        return -1;
-    }
-    if (self->table[index].hash != -1) {
-        PyErr_SetObject(NonUniqueError, key);
-        return -1;
-    }
-    self->table[index].index = offset;
-    self->table[index].hash = hash;
+    ++*self->tablerefs;
     return 0;
 }
 
 
 static int
-fill_intcache(Py_ssize_t size)
+match_object(const void *context, Py_ssize_t offset)
 {
-    PyObject *item;
-    if (!intcache) {
-        intcache = PyList_New(0);
-        if (!intcache) {
-            return -1;
-        }
+    // Comparisons can run arbitrary code, including code that grows, freezes,
+    // or optimizes us. So hold on to the key and the table we're probing while
+    // comparing, and restart if the table was replaced:
+    const objectkey *k = context;
+    FAMObject *self = k->self;
+    PyObject *guess = PyList_GET_ITEM(self->keys, offset);
+    if (guess == k->key) {
+        return 1;
     }
-    for (Py_ssize_t index = PyList_GET_SIZE(intcache); index < size; index++) {
-        item = PyLong_FromSsize_t(index);
-        if (!item) {
-            return -1;
-        }
-        if (PyList_Append(intcache, item)) {
-            Py_DECREF(item);
-            return -1;
-        }
-        Py_DECREF(item);
+    if (pin(self)) {
+        return -1;
     }
-    return 0;
+    entry *table = self->table;
+    Py_ssize_t *tablerefs = self->tablerefs;
+    Py_INCREF(guess);
+    int result = PyObject_RichCompareBool(guess, k->key, Py_EQ);
+    Py_DECREF(guess);
+    int moved = self->table != table;
+    release(table, tablerefs);
+    return (moved && 0 <= result) ? RESTART : result;
 }
 
 
-static int
-grow(FAMObject *self, Py_ssize_t needed)
+static Py_ssize_t
+lookup_hash(FAMObject *self, PyObject *key, Py_hash_t hash)
 {
-    if (fill_intcache(needed)) {
-        return -1;
-    }
-    Py_ssize_t oldsize = self->tablesize;
-    Py_ssize_t newsize = 1;
-    needed /= LOAD;
-    while (newsize <= needed) {
-        newsize <<= 1;
-    }
-    if (newsize <= oldsize) {
-        return 0;
-    }
-    entry *oldentries = self->table;
-    entry *newentries = PyMem_New(entry, newsize + SCAN - 1);
-    if (!newentries) {
-        return -1;
-    }
+    objectkey k = {self, key};
     Py_ssize_t index;
-    for (index = 0; index < newsize + SCAN - 1; index++) {
-        newentries[index].hash = -1;
-        newentries[index].index = -1;
-    }
-    self->table = newentries;
-    self->tablesize = newsize;
-    if (oldsize) {
-        for (index = 0; index < oldsize + SCAN - 1; index++) {
-            if ((oldentries[index].hash != -1) &&
-                insert(self, PyList_GET_ITEM(self->keys,
-                                             oldentries[index].index),
-                       oldentries[index].index, oldentries[index].hash))
-            {
-                PyMem_Del(self->table);
-                self->table = oldentries;
-                self->tablesize = oldsize;
-                return -1;
+    do {
+        if (self->pilots) {
+            index = lookup_perfect(self, hash);
+            if (index == self->tablesize) {
+                return index;
+            }
+            int result = match_object(&k, self->table[index].index);
+            if (!result) {
+                return self->tablesize;
+            }
+            if (result < 0) {
+                index = result;
             }
         }
-    }
-    PyMem_Del(oldentries);
-    return 0;
+        else {
+            index = probe(self->table, self->tablesize, hash, match_object,
+                          &k);
+        }
+    } while (index == RESTART);
+    return index;
 }
 
 
-static FAMObject *
-copy(PyTypeObject *cls, FAMObject *self)
+static Py_hash_t
+hash_string(const char *data, Py_ssize_t size)
 {
-    if (!PyType_IsSubtype(cls, &AMType) && !PyObject_TypeCheck(self, &AMType)) {
-        Py_INCREF(self);
-        return self;
-    }
-    PyObject *keys = PySequence_List(self->keys);
-    if (!keys) {
-        return NULL;
-    }
-    FAMObject *new = (FAMObject *)cls->tp_alloc(cls, 0);
-    if (!new) {
-        Py_DECREF(keys);
-        return NULL;
-    }
-    count += PyList_GET_SIZE(keys);
-    new->keys = keys;
-    new->tablesize = self->tablesize;
-    new->table = PyMem_New(entry, new->tablesize + SCAN - 1);
-    if (!new->table) {
-        Py_DECREF(new);
-        return NULL;
+    // Mix in eight bytes at a time, then finish with mix() so that the low bits
+    // we index with depend on all of them:
+    uint64_t hash = string_seed ^ ((uint64_t)size * 0x9E3779B97F4A7C15ULL);
+    uint64_t word;
+    for (; 8 <= size; data += 8, size -= 8) {
+        memcpy(&word, data, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
     }
-    memcpy(new->table, self->table,
-           (new->tablesize + SCAN - 1) * sizeof(entry));
-    return new;
+    word = 0;
+    memcpy(&word, data, size);
+    Py_hash_t result = (Py_hash_t)mix(hash ^ word);
+    return result == -1 ? -2 : result;
 }
 
 
+
+typedef struct {
+    FAMObject *self;
+    const char *data;
+    Py_ssize_t size;
+} stringkey;
+
+
 static int
-extend(FAMObject *self, PyObject *keys)
+match_string(const void *context, Py_ssize_t offset)
 {
-    keys = PySequence_Fast(keys, "expected an iterable of keys");
-    if (!keys) {
-        return -1;
-    }
-    Py_ssize_t extendsize = PySequence_Fast_GET_SIZE(keys);
-    count += extendsize;
-    if (grow(self, PyList_GET_SIZE(self->keys) + extendsize)) {
-        Py_DECREF(keys);
-        return -1;
-    }
-    PyObject **items = PySequence_Fast_ITEMS(keys);
-    for (Py_ssize_t index = 0; index < extendsize; index++) {
-        if (insert(self, items[index], PyList_GET_SIZE(self->keys), -1) ||
-            PyList_Append(self->keys, items[index]))
+    const stringkey *k = context;
+    Py_ssize_t size;
+    const char *data = string_at(k->self, offset, &size);
+    return size == k->size && !memcmp(data, k->data, size);
+}
+
+
+static Py_ssize_t
+lookup_string(FAMObject *self, const char *data, Py_ssize_t size,
+              Py_hash_t hash)
+{
+    // Like lookup_hash(), but for maps of Arrow strings. Comparing bytes can't
+    // fail or run arbitrary code, so this always finds a slot:
+    stringkey k = {self, data, size};
+    if (self->pilots) {
+        Py_ssize_t index = lookup_perfect(self, hash);
+        if (index != self->tablesize &&
+            !match_string(&k, self->table[index].index))
         {
-            Py_DECREF(keys);
-            return -1;
+            return self->tablesize;
         }
+        return index;
     }
-    Py_DECREF(keys);
-    return 0;
+    return probe(self->table, self->tablesize, hash, match_string, &k);
 }
 
 
-static int
-append(FAMObject *self, PyObject *key)
+static Py_ssize_t
+lookup_unicode(FAMObject *self, PyObject *key)
 {
-    count++;
-    if (grow(self, PyList_GET_SIZE(self->keys) + 1)) {
+    // Only str keys can equal Arrow strings, and equal strs have equal UTF-8:
+    if (!PyUnicode_Check(key)) {
         return -1;
     }
-    if (insert(self, key, PyList_GET_SIZE(self->keys), -1) ||
-        PyList_Append(self->keys, key))
-    {
+    Py_ssize_t size;
+    const char *data = PyUnicode_AsUTF8AndSize(key, &size);
+    if (!data) {
+        // Lone surrogates can't be encoded, so they can't be one of our keys:
+        if (PyErr_ExceptionMatches(PyExc_UnicodeEncodeError)) {
+            PyErr_Clear();
+        }
         return -1;
     }
-    return 0;
+    Py_ssize_t index = lookup_string(self, data, size, hash_string(data, size));
+    return self->table[index].index;
 }
 
 
 static Py_ssize_t
-fam_length(FAMObject *self)
+lower_bound(const int64_t *keys, Py_ssize_t size, int64_t key)
 {
-    return PyList_GET_SIZE(self->keys);
-}
+    // Return the index of the first of keys not less than key. The comparison
+    // only ever chooses which half to keep, which compiles to a conditional
+    // move rather than a branch, so there's nothing to mispredict. Both of the
+    // possible next midpoints are fetched while we wait on this one:
+    if (!size) {
+        return 0;
+    }
+    const int64_t *base = keys;
+    while (1 < size) {
+        Py_ssize_t half = size / 2;
+        PREFETCH(base + half / 2);
+        PREFETCH(base + half + half / 2);
+        base = base[half] < key ? base + half : base;
+        size -= half;
+    }
+    return base - keys + (*base < key);
+}
+
+
+static Py_ssize_t
+gallop(const int64_t *keys, Py_ssize_t size, Py_ssize_t start, int64_t key)
+{
+    // Like lower_bound(), for a key known to be at or after start. Searching
+    // outwards from start first makes a whole sorted batch of queries linear.
+    Py_ssize_t step = 1;
+    while (start + step < size && keys[start + step - 1] < key) {
+        start += step;
+        step <<= 1;
+    }
+    return start + lower_bound(keys + start, Py_MIN(start + step, size) - start,
+                               key);
+}
+
+
+static int
+as_int64(PyObject *key, int64_t *value)
+{
+    // Sorted maps can only contain keys equal to some int64. For a float or an
+    // __index__ key, return 1 (and set value) if key is one of them, 0 if it
+    // isn't, and -1 on error:
+    if (PyFloat_Check(key)) {
+        double d = PyFloat_AS_DOUBLE(key);
+        if (d != floor(d) ||
+            d < -9223372036854775808.0 || 9223372036854775808.0 <= d)
+        {
+            return 0;
+        }
+        *value = (int64_t)d;
+        return 1;
+    }
+    PyObject *index = PyNumber_Index(key);
+    if (!index) {
+        return -1;
+    }
+    int overflow;
+    long long result = PyLong_AsLongLongAndOverflow(index, &overflow);
+    Py_DECREF(index);
+    if (result == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (overflow) {
+        return 0;
+    }
+    *value = result;
+    return 1;
+}
+
+
+// CPython hashes an int as its magnitude modulo this prime, with the int's
+// sign (and, as always, -1 changed to -2):
+
+# if SIZEOF_PY_HASH_T > 4
+# define MODULUS (((uint64_t)1 << 61) - 1)
+# else
+# define MODULUS (((uint64_t)1 << 31) - 1)
+# endif
+
+
+static Py_hash_t
+hash_int64(int64_t value)
+{
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    Py_hash_t hash = (Py_hash_t)(magnitude % MODULUS);
+    if (value < 0) {
+        hash = -hash;
+    }
+    return hash == -1 ? -2 : hash;
+}
+
+
+static int
+equal_at(FAMObject *self, Py_ssize_t index, PyObject *key)
+{
+    PyObject *guess = key_at(self, index);
+    if (!guess) {
+        return -1;
+    }
+    int result = PyObject_RichCompareBool(guess, key, Py_EQ);
+    Py_DECREF(guess);
+    return result;
+}
+
+
+static Py_ssize_t
+search_sorted(FAMObject *self, PyObject *key)
+{
+    // Other keys (like Decimals, Fractions, and complex numbers) can still
+    // equal one of ours. Like the hash table, we only compare them with keys
+    // that have the same hash, and unhashable keys are errors:
+    Py_hash_t hash = PyObject_Hash(key);
+    if (hash == -1) {
+        return -1;
+    }
+# if SIZEOF_PY_HASH_T > 4
+    // Only a handful of int64s share any hash: those whose magnitude has the
+    // right remainder (or 1, for -1's hash of -2). Try each of them:
+    uint64_t remainders[2] = {hash < 0 ? 0 - (uint64_t)hash : (uint64_t)hash,
+                              1};
+    for (int r = 0; r < (hash == -2 ? 2 : 1); r++) {
+        for (uint64_t magnitude = remainders[r];
+             magnitude <= (uint64_t)1 << 63;
+             magnitude += MODULUS)
+        {
+            for (int negative = 0; negative < 2; negative++) {
+                if (!negative && (uint64_t)INT64_MAX < magnitude) {
+                    continue;
+                }
+                int64_t value = negative ? (int64_t)(0 - magnitude)
+                                         : (int64_t)magnitude;
+                if (hash_int64(value) != hash) {
+                    continue;
+                }
+                Py_ssize_t index = lower_bound(self->sorted, self->keys_size,
+                                               value);
+                if (index == self->keys_size || self->sorted[index] != value) {
+                    continue;
+                }
+                int result = equal_at(self, index, key);
+                if (result) {
+                    return result < 0 ? -1 : index;
+                }
+            }
+        }
+    }
+# else
+    // With 32-bit hashes, billions of int64s share each one, so just scan:
+    for (Py_ssize_t index = 0; index < self->keys_size; index++) {
+        if (hash_int64(self->sorted[index]) == hash) {
+            int result = equal_at(self, index, key);
+            if (result) {
+                return result < 0 ? -1 : index;
+            }
+        }
+    }
+# endif
+    return -1;
+}
+
+
+static Py_ssize_t
+lookup_sorted(FAMObject *self, PyObject *key)
+{
+    if (!PyFloat_Check(key) && !PyIndex_Check(key)) {
+        return search_sorted(self, key);
+    }
+    int64_t value;
+    int result = as_int64(key, &value);
+    if (result <= 0) {
+        return -1;
+    }
+    Py_ssize_t index = lower_bound(self->sorted, self->keys_size, value);
+    if (index < self->keys_size && self->sorted[index] == value) {
+        return index;
+    }
+    return -1;
+}
+
+
+static int build(FAMObject *);
+
+
+static Py_ssize_t
+lookup(FAMObject *self, PyObject *key, Py_hash_t hash) {
+    if (build(self)) {
+        return -1;
+    }
+    if (self->strings) {
+        return lookup_unicode(self, key);
+    }
+    if (self->sorted) {
+        return lookup_sorted(self, key);
+    }
+    if (hash == -1) {
+        hash = PyObject_Hash(key);
+        if (hash == -1) {
+            return -1;
+        }
+    }
+    if (self->filter && !filter_check(self, hash)) {
+        return -1;
+    }
+    Py_ssize_t index = lookup_hash(self, key, hash);
+    if (index < 0) {
+        return -1;
+    }
+    index = self->table[index].index;
+    // Snapshots share their table with a live AutoMap, so they may see entries
+    // for keys that were appended after they were taken:
+    if (self->keys_size <= index) {
+        return -1;
+    }
+    return index;
+}
+
+
+static void
+set_key_error(PyObject *exception, PyObject *key)
+{
+    // PyErr_SetObject() would unpack a tuple key into the exception's args:
+    PyObject *args = PyTuple_Pack(1, key);
+    if (args) {
+        PyErr_SetObject(exception, args);
+        Py_DECREF(args);
+    }
+}
+
+
+static int
+insert(FAMObject *self, PyObject *key, Py_ssize_t offset, Py_hash_t hash)
+{
+    if (hash == -1) {
+        hash = PyObject_Hash(key);
+        if (hash == -1) {
+            return -1;
+        }
+    }
+    Py_ssize_t index = lookup_hash(self, key, hash);
+    if (index < 0) {
+        return -1;
+    }
+    if (self->table[index].hash != -1) {
+        set_key_error(NonUniqueError, key);
+        return -1;
+    }
+    self->table[index].index = offset;
+    self->table[index].hash = hash;
+    if (self->filter) {
+        filter_add(self, hash);
+    }
+    return 0;
+}
+
+
+// Bulk insertion is bound by cache misses on the table once it's bigger than
+// the cache, so we work in batches: first hash each key in the batch and
+// prefetch its home slot, then insert them all. By the time we get to each
+// insertion, its slot is (hopefully) already on its way in. hash_batch() is
+// the first half, shared by every kind of map: it hashes keys start through
+// stop - 1 with hash(), and returns where it stopped. That's short of stop if
+// a hash failed, with an exception set.
+
+typedef Py_hash_t (*hasher)(const void *context, Py_ssize_t i);
+
+
+static inline Py_ssize_t
+hash_batch(const entry *table, Py_ssize_t tablesize, Py_ssize_t start,
+           Py_ssize_t stop, hasher hash, const void *context,
+           Py_hash_t *hashes)
+{
+    Py_ssize_t mask = tablesize - 1;
+    Py_ssize_t i;
+    for (i = start; i < stop; i++) {
+        Py_hash_t h = hash(context, i);
+        if (h == -1) {
+            break;
+        }
+        hashes[i - start] = h;
+        PREFETCH(&table[h & mask]);
+    }
+    return i;
+}
+
+
+static Py_hash_t
+hash_object(const void *context, Py_ssize_t i)
+{
+    return PyObject_Hash(((PyObject *const *)context)[i]);
+}
+
+
+static int
+insert_many(FAMObject *self, PyObject **keys, Py_ssize_t size,
+            Py_ssize_t offset, int append)
+{
+    // Insert keys in batches with hash_batch(). If append is set, each key is
+    // also appended to our keys as it's inserted. Otherwise, they're already
+    // there, starting at offset.
+    Py_hash_t hashes[BATCH];
+    for (Py_ssize_t start = 0; start < size; start += BATCH) {
+        Py_ssize_t stop = Py_MIN(size, start + BATCH);
+        Py_ssize_t hashed = hash_batch(self->table, self->tablesize, start,
+                                       stop, hash_object, keys, hashes);
+        // If a key failed to hash, insert everything before it first. That way
+        // we fail in the same state as if we'd gone one key at a time:
+        PyObject *type, *value, *traceback;
+        int failed = hashed < stop;
+        if (failed) {
+            PyErr_Fetch(&type, &value, &traceback);
+        }
+        for (Py_ssize_t i = start; i < hashed; i++) {
+            Py_ssize_t index = append ? self->keys_size : offset + i;
+            if (insert(self, keys[i], index, hashes[i - start]) ||
+                (append && PyList_Append(self->keys, keys[i])))
+            {
+                if (failed) {
+                    Py_XDECREF(type);
+                    Py_XDECREF(value);
+                    Py_XDECREF(traceback);
+                }
+                return -1;
+            }
+            if (append) {
+                self->keys_size++;
+                count++;
+            }
+        }
+        if (failed) {
+            PyErr_Restore(type, value, traceback);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int
+fill_intcache(Py_ssize_t size)
+{
+    PyObject *item;
+    if (!intcache) {
+        intcache = PyList_New(0);
+        if (!intcache) {
+            return -1;
+        }
+    }
+    for (Py_ssize_t index = PyList_GET_SIZE(intcache); index < size; index++) {
+        item = PyLong_FromSsize_t(index);
+        if (!item) {
+            return -1;
+        }
+        if (PyList_Append(intcache, item)) {
+            Py_DECREF(item);
+            return -1;
+        }
+        Py_DECREF(item);
+    }
+    return 0;
+}
+
+
+// Each table is preceded by a header recording how it was allocated. That way
+// it can still be freed correctly after the allocator or the huge page
+// threshold have changed. Tables from a custom allocator also hold a reference
+// to its capsule, so that it outlives them even if it's replaced.
+
+typedef struct {
+    void *base;
+    size_t size;
+    void *ctx;
+    void (*free)(void *ctx, void *ptr, size_t size);
+    PyObject *capsule;
+} tableheader;
+
+
+static void
+discount(Py_ssize_t size)
+{
+    // Called when a mapping with size keys goes away:
+    count -= size;
+    if (!count) {
+        Py_CLEAR(intcache);
+    }
+    else if (count < PyList_GET_SIZE(intcache)) {
+        // del intcache[count:]
+        PyList_SetSlice(intcache, count, PyList_GET_SIZE(intcache), NULL);
+    }
+}
+
+
+static void
+pymem_free(void *ctx, void *ptr, size_t size)
+{
+    PyMem_Free(ptr);
+}
+
+
+# if defined(__linux__) && defined(MADV_HUGEPAGE)
+
+static void
+munmap_free(void *ctx, void *ptr, size_t size)
+{
+    munmap(ptr, size);
+}
+
+# endif
+
+
+static void *
+aligned_new(size_t bytes)
+{
+    // Allocate bytes of cache-aligned memory for a table (or a filter), with a
+    // tableheader in front so that table_free() can release it:
+    if ((size_t)PY_SSIZE_T_MAX - sizeof(tableheader) - ALIGNMENT < bytes) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    size_t size = sizeof(tableheader) + ALIGNMENT - 1 + bytes;
+    void *base = NULL;
+    void *ctx = NULL;
+    void (*dealloc)(void *, void *, size_t) = NULL;
+    PyObject *capsule = NULL;
+    if (allocator.malloc) {
+        base = allocator.malloc(allocator.ctx, size);
+        ctx = allocator.ctx;
+        dealloc = allocator.free;
+        capsule = allocator_capsule;
+    }
+# if defined(__linux__) && defined(MADV_HUGEPAGE)
+    else if (0 <= huge_page_threshold &&
+             (size_t)huge_page_threshold <= size)
+    {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            base = NULL;
+        }
+        else {
+            // This is only advice, so there's nothing to do if it's refused:
+            madvise(base, size, MADV_HUGEPAGE);
+            dealloc = munmap_free;
+        }
+    }
+# endif
+    if (!dealloc) {
+        base = PyMem_Malloc(size);
+        dealloc = pymem_free;
+    }
+    if (!base) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    uintptr_t start = (uintptr_t)base + sizeof(tableheader);
+    start = (start + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1);
+    tableheader *header = (tableheader *)start - 1;
+    header->base = base;
+    header->size = size;
+    header->ctx = ctx;
+    header->free = dealloc;
+    header->capsule = capsule;
+    Py_XINCREF(capsule);
+    return (void *)start;
+}
+
+
+static entry *
+table_new(Py_ssize_t entries)
+{
+    if ((size_t)PY_SSIZE_T_MAX / sizeof(entry) < (size_t)entries) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return aligned_new(entries * sizeof(entry));
+}
+
+
+static void
+table_free(entry *table)
+{
+    if (!table) {
+        return;
+    }
+    tableheader *header = (tableheader *)table - 1;
+    PyObject *capsule = header->capsule;
+    header->free(header->ctx, header->base, header->size);
+    Py_XDECREF(capsule);
+}
+
+
+static Py_ssize_t
+table_size(Py_ssize_t needed)
+{
+    Py_ssize_t size = 1;
+    needed /= LOAD;
+    while (size <= needed) {
+        size <<= 1;
+    }
+    return size;
+}
+
+
+static entry *
+table_empty(Py_ssize_t tablesize)
+{
+    entry *table = table_new(tablesize + SCAN - 1);
+    if (!table) {
+        return NULL;
+    }
+    for (Py_ssize_t index = 0; index < tablesize + SCAN - 1; index++) {
+        table[index].hash = -1;
+        table[index].index = -1;
+    }
+    return table;
+}
+
+
+static Py_ssize_t
+table_length(FAMObject *self)
+{
+    // The number of entries actually allocated for our table:
+    if (self->pilots) {
+        return self->tablesize + 1;
+    }
+    return self->tablesize + SCAN - 1;
+}
+
+
+static uint64_t *
+filter_new(Py_ssize_t tablesize, Py_ssize_t *blocks)
+{
+    // Filters come from the same allocator as tables, so they're cache-line
+    // aligned too. They're sized in bytes, since entries are only 8 bytes wide
+    // on 32-bit builds:
+    Py_BUILD_ASSERT(FILTER_BLOCK == ALIGNMENT);
+    // About one byte per table slot:
+    *blocks = Py_MAX(1, tablesize / (Py_ssize_t)FILTER_BLOCK);
+    uint64_t *filter = aligned_new(*blocks * FILTER_BLOCK);
+    if (filter) {
+        memset(filter, 0, *blocks * FILTER_BLOCK);
+    }
+    return filter;
+}
+
+
+static void
+release(entry *table, Py_ssize_t *tablerefs)
+{
+    // Tables are only reference-counted once they've been shared by a
+    // snapshot. Otherwise, tablerefs is NULL and we're the sole owner.
+    if (tablerefs && --*tablerefs) {
+        return;
+    }
+    PyMem_Free(tablerefs);
+    table_free(table);
+}
+
+
+static int
+rehash(FAMObject *self, entry *entries, Py_ssize_t length)
+{
+    // Insert every entry of another table (ours or our source's) that refers
+    // to one of our keys, reusing its stored hash.
+    Py_ssize_t mask = self->tablesize - 1;
+    for (Py_ssize_t index = 0; index < length; index++) {
+        // The old table is read sequentially, but writes to the new one are
+        // scattered, so fetch their home slots a little ahead of time:
+        if (index + BATCH < length) {
+            PREFETCH(&self->table[entries[index + BATCH].hash & mask]);
+        }
+        if ((entries[index].hash != -1) &&
+            (entries[index].index < self->keys_size) &&
+            insert(self, PyList_GET_ITEM(self->keys, entries[index].index),
+                   entries[index].index, entries[index].hash))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int
+resize(FAMObject *self, Py_ssize_t newsize)
+{
+    // If we have a filter, it's rebuilt alongside the table by insert():
+    entry *oldentries = self->table;
+    Py_ssize_t oldsize = self->tablesize;
+    Py_ssize_t oldlength = oldentries ? table_length(self) : 0;
+    uint64_t *oldfilter = self->filter;
+    Py_ssize_t oldblocks = self->filterblocks;
+    entry *newentries = table_empty(newsize);
+    if (!newentries) {
+        return -1;
+    }
+    if (self->filtered) {
+        self->filter = filter_new(newsize, &self->filterblocks);
+        if (!self->filter) {
+            table_free(newentries);
+            self->filter = oldfilter;
+            self->filterblocks = oldblocks;
+            return -1;
+        }
+    }
+    self->table = newentries;
+    self->tablesize = newsize;
+    if (rehash(self, oldentries, oldlength)) {
+        table_free(self->table);
+        self->table = oldentries;
+        self->tablesize = oldsize;
+        if (self->filter != oldfilter) {
+            table_free((entry *)self->filter);
+            self->filter = oldfilter;
+            self->filterblocks = oldblocks;
+        }
+        return -1;
+    }
+    release(oldentries, self->tablerefs);
+    self->tablerefs = NULL;
+    if (self->filter != oldfilter) {
+        table_free((entry *)oldfilter);
+    }
+    return 0;
+}
+
+
+static int
+grow(FAMObject *self, Py_ssize_t needed)
+{
+    if (fill_intcache(needed)) {
+        return -1;
+    }
+    if (table_size(needed) <= self->tablesize) {
+        return 0;
+    }
+    return resize(self, table_size(needed));
+}
+
+
+static Py_hash_t
+hash_string_at(const void *context, Py_ssize_t i)
+{
+    Py_ssize_t size;
+    const char *data = string_at((FAMObject *)context, i, &size);
+    return hash_string(data, size);
+}
+
+
+static int
+insert_strings(FAMObject *self)
+{
+    // Insert all of our Arrow strings, batched like insert_many(). Hashing
+    // them is cheap (and can't fail), but the table is just as big.
+    Py_hash_t hashes[BATCH];
+    for (Py_ssize_t start = 0; start < self->keys_size; start += BATCH) {
+        Py_ssize_t stop = Py_MIN(self->keys_size, start + BATCH);
+        Py_ssize_t size;
+        const char *data;
+        hash_batch(self->table, self->tablesize, start, stop, hash_string_at,
+                   self, hashes);
+        for (Py_ssize_t i = start; i < stop; i++) {
+            data = string_at(self, i, &size);
+            Py_ssize_t index = lookup_string(self, data, size,
+                                             hashes[i - start]);
+            if (self->table[index].hash != -1) {
+                PyObject *key = key_at(self, i);
+                if (key) {
+                    set_key_error(NonUniqueError, key);
+                    Py_DECREF(key);
+                }
+                return -1;
+            }
+            self->table[index].index = i;
+            self->table[index].hash = hashes[i - start];
+        }
+    }
+    return 0;
+}
+
+
+static int
+build(FAMObject *self)
+{
+    // Lazily-constructed maps don't get a table until something needs one. This
+    // is also the point where they find out whether their keys are unique.
+    // Sorted maps never need one:
+    if (self->table || self->sorted) {
+        return 0;
+    }
+    if (grow(self, self->keys_size) ||
+        (self->strings ?
+         insert_strings(self) :
+         insert_many(self, PySequence_Fast_ITEMS(self->keys), self->keys_size,
+                     0, 0)))
+    {
+        table_free(self->table);
+        self->table = NULL;
+        self->tablesize = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+static int
+trim(PyObject *list)
+{
+    // Release any over-allocated space at the end of a list's item array.
+    // There's no public API for this, so we have to reach into the list itself
+    // (PyPy lists don't expose their storage, so we just leave them alone):
+# ifndef PYPY_VERSION
+    PyListObject *l = (PyListObject *)list;
+    Py_ssize_t size = PyList_GET_SIZE(list);
+    if (size == l->allocated) {
+        return 0;
+    }
+    if (!size) {
+        PyMem_Free(l->ob_item);
+        l->ob_item = NULL;
+        l->allocated = 0;
+        return 0;
+    }
+    PyObject **items = PyMem_Realloc(l->ob_item, size * sizeof(PyObject *));
+    if (!items) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    l->ob_item = items;
+    l->allocated = size;
+# endif
+    return 0;
+}
+
+
+static int
+fit(FAMObject *self)
+{
+    // Drop any room we've kept for more keys: the list's spare capacity, and
+    // any excess table left behind by an update() that failed partway through.
+    if (trim(self->keys)) {
+        return -1;
+    }
+    if (self->table && table_size(self->keys_size) < self->tablesize) {
+        return resize(self, table_size(self->keys_size));
+    }
+    return 0;
+}
+
+
+static PyObject *
+keys_list(FAMObject *self)
+{
+    // Snapshots share a list with the AutoMap they were taken from, which may
+    // have grown since. Return a new reference to a list of only our own keys:
+    if (!self->keys) {
+        PyObject *keys = PyList_New(self->keys_size);
+        if (!keys) {
+            return NULL;
+        }
+        for (Py_ssize_t i = 0; i < self->keys_size; i++) {
+            PyObject *key = key_at(self, i);
+            if (!key) {
+                Py_DECREF(keys);
+                return NULL;
+            }
+            PyList_SET_ITEM(keys, i, key);
+        }
+        return keys;
+    }
+    if (PyList_GET_SIZE(self->keys) == self->keys_size) {
+        Py_INCREF(self->keys);
+        return self->keys;
+    }
+    return PyList_GetSlice(self->keys, 0, self->keys_size);
+}
+
+
+static FAMObject *
+copy(PyTypeObject *cls, FAMObject *self, Py_ssize_t needed)
+{
+    // The copy's table is sized for needed keys, so that anything about to be
+    // added to it (like by |) doesn't have to grow it again.
+    // Copies of Arrow-backed and sorted maps get real keys (and a table to
+    // match), since they're usually made to be extended. Copies of optimized
+    // maps get an ordinary table, for the same reason:
+    PyObject *keys = self->keys ?
+                     PyList_GetSlice(self->keys, 0, self->keys_size) :
+                     keys_list(self);
+    if (!keys) {
+        return NULL;
+    }
+    FAMObject *new = (FAMObject *)cls->tp_alloc(cls, 0);
+    if (!new) {
+        Py_DECREF(keys);
+        return NULL;
+    }
+    count += self->keys_size;
+    new->keys = keys;
+    new->keys_size = self->keys_size;
+    new->filtered = self->filtered;
+    if (!self->keys || self->pilots) {
+        if (build(new)) {
+            Py_DECREF(new);
+            return NULL;
+        }
+        return new;
+    }
+    if (!self->table) {
+        // Still lazy, so there's no table to copy:
+        return new;
+    }
+    new->tablesize = table_size(needed);
+    if (new->tablesize == self->tablesize &&
+        PyList_GET_SIZE(self->keys) == self->keys_size &&
+        (self->filter || !self->filtered))
+    {
+        new->table = table_new(new->tablesize + SCAN - 1);
+        if (!new->table) {
+            Py_DECREF(new);
+            return NULL;
+        }
+        memcpy(new->table, self->table,
+               (new->tablesize + SCAN - 1) * sizeof(entry));
+        if (self->filter) {
+            new->filter = filter_new(new->tablesize, &new->filterblocks);
+            if (!new->filter) {
+                Py_DECREF(new);
+                return NULL;
+            }
+            memcpy(new->filter, self->filter,
+                   new->filterblocks * FILTER_BLOCK);
+        }
+        return new;
+    }
+    // Otherwise, the table is the wrong size, or we're copying a snapshot (and
+    // need to leave out any entries added to its table after it was taken):
+    new->table = table_empty(new->tablesize);
+    if (!new->table) {
+        Py_DECREF(new);
+        return NULL;
+    }
+    if (new->filtered) {
+        new->filter = filter_new(new->tablesize, &new->filterblocks);
+        if (!new->filter) {
+            Py_DECREF(new);
+            return NULL;
+        }
+    }
+    if (rehash(new, self->table, table_length(self))) {
+        Py_DECREF(new);
+        return NULL;
+    }
+    return new;
+}
+
+
+static int
+extend(FAMObject *self, PyObject *keys)
+{
+    if (PyObject_TypeCheck(keys, &FAMType)) {
+        keys = keys_list((FAMObject *)keys);
+    }
+    else {
+        keys = PySequence_Fast(keys, "expected an iterable of keys");
+    }
+    if (!keys) {
+        return -1;
+    }
+    Py_ssize_t extendsize = PySequence_Fast_GET_SIZE(keys);
+    if (build(self) ||
+        grow(self, self->keys_size + extendsize) ||
+        insert_many(self, PySequence_Fast_ITEMS(keys), extendsize, 0, 1))
+    {
+        Py_DECREF(keys);
+        return -1;
+    }
+    Py_DECREF(keys);
+    return 0;
+}
+
+
+static int
+append(FAMObject *self, PyObject *key)
+{
+    if (build(self) || grow(self, self->keys_size + 1)) {
+        return -1;
+    }
+    if (insert(self, key, self->keys_size, -1) ||
+        PyList_Append(self->keys, key))
+    {
+        return -1;
+    }
+    self->keys_size++;
+    count++;
+    return 0;
+}
+
+
+static Py_ssize_t
+fam_length(FAMObject *self)
+{
+    return self->keys_size;
+}
+
+
+static PyObject *
+get(FAMObject *self, PyObject *key, PyObject *missing) {
+    Py_ssize_t result = lookup(self, key, -1);
+    if (result < 0) {
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        if (missing) {
+            Py_INCREF(missing);
+            return missing;
+        }
+        set_key_error(PyExc_KeyError, key);
+        return NULL;
+    }
+    PyObject *index = PyList_GET_ITEM(intcache, result);
+    Py_INCREF(index);
+    return index;
+}
+
+
+static PyObject *
+fam_subscript(FAMObject *self, PyObject *key)
+{
+    return get(self, key, NULL);
+}
+
+
+static PyMappingMethods fam_as_mapping = {
+    .mp_length = (lenfunc) fam_length,
+    .mp_subscript = (binaryfunc) fam_subscript,
+};
+
+
+static PyObject *
+fam_or(PyObject *left, PyObject *right)
+{
+    if (!PyObject_TypeCheck(left, &FAMType) ||
+        !PyObject_TypeCheck(right, &FAMType)
+    ) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    FAMObject *updated = copy(Py_TYPE(left), (FAMObject *)left,
+                              ((FAMObject *)left)->keys_size +
+                              ((FAMObject *)right)->keys_size);
+    if (!updated) {
+        return NULL;
+    }
+    if (extend(updated, right) ||
+        (!PyObject_TypeCheck(updated, &AMType) && trim(updated->keys)))
+    {
+        Py_DECREF(updated);
+        return NULL;
+    }
+    return (PyObject *)updated;
+}
+
+
+static PyNumberMethods fam_as_number = {
+    .nb_or = (binaryfunc) fam_or,
+};
+
+
+static int
+fam_contains(FAMObject *self, PyObject *key)
+{
+    if (lookup(self, key, -1) < 0) {
+        if (PyErr_Occurred()) {
+            return -1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+
+static PySequenceMethods fam_as_sequence = {
+    .sq_contains = (objobjproc) fam_contains,
+};
+
+
+static void
+fam_dealloc(FAMObject *self)
+{
+    release(self->table, self->tablerefs);
+    discount(self->keys_size);
+    Py_XDECREF(self->keys);
+    Py_XDECREF(self->strings);
+    PyMem_Free(self->pilots);
+    PyMem_Free(self->sorted);
+    table_free((entry *)self->filter);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+
+static Py_hash_t
+fam_hash(FAMObject *self)
+{
+    if (build(self)) {
+        return -1;
+    }
+    if (!self->keys || self->pilots) {
+        // Our table is laid out differently than an equal map of ordinary keys,
+        // but we need to hash the same. This is rare enough that just building
+        // one is fine:
+        FAMObject *keys = copy(&FAMType, self, self->keys_size);
+        if (!keys) {
+            return -1;
+        }
+        Py_hash_t hash = fam_hash(keys);
+        Py_DECREF(keys);
+        return hash;
+    }
+    Py_hash_t hash = 0;
+    for (Py_ssize_t i = 0; i < self->tablesize; i++) {
+        // Entries added after a snapshot was taken count as empty slots:
+        if (self->keys_size <= self->table[i].index) {
+            hash = hash * 3 - 1;
+            continue;
+        }
+        hash = hash * 3 + self->table[i].hash;
+    }
+    if (hash == -1) {
+        return 0;
+    }
+    return hash;
+}
+
+
+static PyObject *
+fam_iter(FAMObject *self)
+{
+    return iter(self, KEYS, 0);
+}
+
+
+static PyObject *
+fam___getnewargs_ex__(FAMObject *self)
+{
+    // Sorted and filtered maps need their mode passed back to the constructor
+    // when unpickled, or they come back as ordinary maps:
+    PyObject *keys = keys_list(self);
+    if (!keys) {
+        return NULL;
+    }
+    PyObject *kwargs = PyDict_New();
+    if (!kwargs ||
+        (self->sorted && PyDict_SetItemString(kwargs, "sorted", Py_True)) ||
+        (self->filtered && PyDict_SetItemString(kwargs, "bloom", Py_True)))
+    {
+        Py_DECREF(keys);
+        Py_XDECREF(kwargs);
+        return NULL;
+    }
+    return Py_BuildValue("(N)N", keys, kwargs);
+}
+
+
+static PyObject *
+fam___reversed__(FAMObject *self)
+{
+    return iter(self, KEYS, 1);
+}
+
+
+static PyObject *
+fam___sizeof__(FAMObject *self)
+{
+    // Arrow buffers belong to whoever exported them, so they aren't counted:
+    Py_ssize_t listbytes = 0;
+    if (self->keys) {
+        PyObject *listsizeof = PyObject_CallMethod(self->keys, "__sizeof__",
+                                                   NULL);
+        if (!listsizeof) {
+            return NULL;
+        }
+        listbytes = PyLong_AsSsize_t(listsizeof);
+        Py_DECREF(listsizeof);
+        if (listbytes == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    Py_ssize_t tablebytes = 0;
+    if (self->table) {
+        tablebytes = table_length(self) * sizeof(entry);
+    }
+    tablebytes += self->buckets * sizeof(uint16_t);
+    if (self->sorted) {
+        tablebytes += self->keys_size * sizeof(int64_t);
+    }
+    if (self->filter) {
+        tablebytes += self->filterblocks * FILTER_BLOCK;
+    }
+    return PyLong_FromSsize_t(
+        Py_TYPE(self)->tp_basicsize + listbytes + tablebytes
+    );
+}
+
+
+static PyObject *
+fam_get(FAMObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    // This is called a lot, so avoid the overhead of argument parsing:
+    if (nargs == 1) {
+        return get(self, args[0], Py_None);
+    }
+    if (nargs == 2) {
+        return get(self, args[0], args[1]);
+    }
+    PyErr_Format(PyExc_TypeError, "get expected 1 or 2 arguments, got %zd",
+                 nargs);
+    return NULL;
+}
+
+
+static PyObject *
+new_indexer(Py_ssize_t size, int64_t **data)
+{
+    PyObject *bytes = PyByteArray_FromStringAndSize(NULL,
+                                                    size * sizeof(int64_t));
+    if (!bytes) {
+        return NULL;
+    }
+    *data = (int64_t *)PyByteArray_AS_STRING(bytes);
+    return bytes;
+}
+
+
+static PyObject *
+finish_indexer(PyObject *bytes)
+{
+    PyObject *memory = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (!memory) {
+        return NULL;
+    }
+    PyObject *indexer = PyObject_CallMethod(memory, "cast", "s", "q");
+    Py_DECREF(memory);
+    return indexer;
+}
+
+
+static PyObject *
+sorted_get_indexer(FAMObject *self, PyObject *other)
+{
+    // Sorted maps merge their keys with the queries instead: each search picks
+    // up where the last one left off, unless the queries go backwards.
+    int64_t *data;
+    PyObject *keys = NULL;
+    const int64_t *values = NULL;
+    Py_ssize_t size;
+    if (PyObject_TypeCheck(other, &FAMType) && ((FAMObject *)other)->sorted) {
+        values = ((FAMObject *)other)->sorted;
+        size = ((FAMObject *)other)->keys_size;
+    }
+    else {
+        keys = PySequence_Fast(other, "expected an iterable of keys");
+        if (!keys) {
+            return NULL;
+        }
+        size = PySequence_Fast_GET_SIZE(keys);
+    }
+    PyObject *bytes = new_indexer(size, &data);
+    if (!bytes) {
+        Py_XDECREF(keys);
+        return NULL;
+    }
+    Py_ssize_t position = 0;
+    int64_t previous = INT64_MIN;
+    for (Py_ssize_t i = 0; i < size; i++) {
+        int64_t value;
+        if (values) {
+            value = values[i];
+        }
+        else {
+            PyObject *key = PySequence_Fast_GET_ITEM(keys, i);
+            if (!PyFloat_Check(key) && !PyIndex_Check(key)) {
+                data[i] = search_sorted(self, key);
+                if (data[i] < 0 && PyErr_Occurred()) {
+                    Py_DECREF(keys);
+                    Py_DECREF(bytes);
+                    return NULL;
+                }
+                continue;
+            }
+            int result = as_int64(key, &value);
+            if (result < 0) {
+                Py_DECREF(keys);
+                Py_DECREF(bytes);
+                return NULL;
+            }
+            if (!result) {
+                data[i] = -1;
+                continue;
+            }
+        }
+        position = previous <= value ?
+                   gallop(self->sorted, self->keys_size, position, value) :
+                   lower_bound(self->sorted, self->keys_size, value);
+        previous = value;
+        data[i] = (position < self->keys_size &&
+                   self->sorted[position] == value) ? position : -1;
+    }
+    Py_XDECREF(keys);
+    return finish_indexer(bytes);
+}
+
+
+static PyObject *
+fam_get_indexer(FAMObject *self, PyObject *other)
+{
+    // Returns a memoryview of int64 positions in self for each key of other,
+    // with -1 for missing keys. When other is also an automap, we walk its
+    // table instead of its keys so that we can reuse the hashes it has already
+    // computed, rather than calling back into each key's __hash__.
+    int64_t *data;
+    if (self->sorted) {
+        return sorted_get_indexer(self, other);
+    }
+    if (build(self)) {
+        return NULL;
+    }
+    // If other is still lazy, building its table just to walk it would be no
+    // faster than hashing its keys, so treat it like any other iterable. The
+    // same goes for when only one of us uses Arrow strings, since our hashes
+    // won't agree:
+    if (!PyObject_TypeCheck(other, &FAMType) ||
+        !((FAMObject *)other)->table ||
+        !((FAMObject *)other)->strings != !self->strings)
+    {
+        PyObject *keys = PySequence_Fast(other, "expected an iterable of keys");
+        if (!keys) {
+            return NULL;
+        }
+        Py_ssize_t size = PySequence_Fast_GET_SIZE(keys);
+        PyObject *bytes = new_indexer(size, &data);
+        if (!bytes) {
+            Py_DECREF(keys);
+            return NULL;
+        }
+        for (Py_ssize_t index = 0; index < size; index++) {
+            Py_ssize_t result = lookup(self,
+                                       PySequence_Fast_GET_ITEM(keys, index),
+                                       -1);
+            if (result < 0 && PyErr_Occurred()) {
+                Py_DECREF(keys);
+                Py_DECREF(bytes);
+                return NULL;
+            }
+            data[index] = result;
+        }
+        Py_DECREF(keys);
+        return finish_indexer(bytes);
+    }
+    FAMObject *map = (FAMObject *)other;
+    Py_ssize_t size = map->keys_size;
+    PyObject *bytes = new_indexer(size, &data);
+    if (!bytes) {
+        return NULL;
+    }
+    if (map == self) {
+        for (Py_ssize_t index = 0; index < size; index++) {
+            data[index] = index;
+        }
+        return finish_indexer(bytes);
+    }
+    // Comparisons can run arbitrary code, including code that grows or freezes
+    // other. So, like a snapshot, we hold on to its current table and keys, and
+    // ignore anything added after we started:
+    if (pin(map)) {
+        Py_DECREF(bytes);
+        return NULL;
+    }
+    entry *table = map->table;
+    Py_ssize_t *tablerefs = map->tablerefs;
+    Py_ssize_t length = table_length(map);
+    PyObject *keys = map->keys;
+    Py_XINCREF(keys);
+    for (Py_ssize_t i = 0; i < length; i++) {
+        entry e = table[i];
+        if (e.hash == -1 || size <= e.index) {
+            continue;
+        }
+        if (self->filter && !filter_check(self, e.hash)) {
+            data[e.index] = -1;
+            continue;
+        }
+        Py_ssize_t index;
+        if (self->strings) {
+            Py_ssize_t keysize;
+            const char *key = string_at(map, e.index, &keysize);
+            index = lookup_string(self, key, keysize, e.hash);
+        }
+        else {
+            PyObject *key = PyList_GET_ITEM(keys, e.index);
+            index = lookup_hash(self, key, e.hash);
+            if (index < 0) {
+                release(table, tablerefs);
+                Py_XDECREF(keys);
+                Py_DECREF(bytes);
+                return NULL;
+            }
+        }
+        Py_ssize_t result = self->table[index].index;
+        data[e.index] = result < self->keys_size ? result : -1;
+    }
+    release(table, tablerefs);
+    Py_XDECREF(keys);
+    return finish_indexer(bytes);
+}
+
+
+static int
+slice_bound(FAMObject *self, PyObject *bound, int upper, Py_ssize_t *index)
+{
+    // Set index to the position of the first key greater than (if upper) or
+    // not less than (otherwise) bound. None is unbounded.
+    if (bound == Py_None) {
+        *index = upper ? self->keys_size : 0;
+        return 0;
+    }
+    PyObject *integer = PyNumber_Index(bound);
+    if (!integer) {
+        return -1;
+    }
+    int overflow;
+    long long value = PyLong_AsLongLongAndOverflow(integer, &overflow);
+    Py_DECREF(integer);
+    if (value == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (overflow) {
+        *index = 0 < overflow ? self->keys_size : 0;
+    }
+    else if (upper && value == INT64_MAX) {
+        *index = self->keys_size;
+    }
+    else {
+        *index = lower_bound(self->sorted, self->keys_size, value + upper);
+    }
+    return 0;
+}
+
+
+static PyObject *
+fam_slice_locs(FAMObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    // Return (start, stop) such that our keys from start up to (but not
+    // including) stop are exactly those between lo and hi, inclusive:
+    if (!self->sorted) {
+        PyErr_SetString(PyExc_TypeError,
+                        "slice_locs requires a map constructed with "
+                        "sorted=True");
+        return NULL;
+    }
+    if (nargs != 2) {
+        PyErr_Format(PyExc_TypeError,
+                     "slice_locs expected 2 arguments, got %zd", nargs);
+        return NULL;
+    }
+    Py_ssize_t start, stop;
+    if (slice_bound(self, args[0], 0, &start) ||
+        slice_bound(self, args[1], 1, &stop))
+    {
+        return NULL;
+    }
+    return Py_BuildValue("nn", start, Py_MAX(start, stop));
+}
+
+
+static PyObject *
+fam_items(FAMObject *self)
+{
+    return view(self, ITEMS);
+}
+
+
+static PyObject *
+fam_keys(FAMObject *self)
+{
+    return view(self, KEYS);
+}
+
+
+static PyObject *
+fam_values(FAMObject *self)
+{
+    return view(self, VALUES);
+}
+
+
+static int
+place_bucket(uint16_t *pilots, Py_ssize_t buckets, entry *bucket,
+             Py_ssize_t size, Py_ssize_t *slots, uint8_t *taken, entry *table,
+             Py_ssize_t tablesize)
+{
+    // Find a pilot that sends every key in the bucket to its own free slot.
+    // Most tries fail, so free slots are tracked in a bitmap that's small
+    // enough to stay cached instead of in the table itself.
+    // Keys with equal hashes can never be separated, so give up right away:
+    for (Py_ssize_t i = 0; i < size; i++) {
+        for (Py_ssize_t j = 0; j < i; j++) {
+            if (bucket[i].hash == bucket[j].hash) {
+                return -1;
+            }
+        }
+    }
+    for (uint32_t pilot = 0; pilot < PILOTS; pilot++) {
+        Py_ssize_t placed = 0;
+        for (; placed < size; placed++) {
+            Py_ssize_t slot = perfect_slot(mix(bucket[placed].hash), pilot,
+                                           tablesize);
+            if (taken[slot >> 3] & (1 << (slot & 7))) {
+                break;
+            }
+            Py_ssize_t j = 0;
+            while (j < placed && slots[j] != slot) {
+                j++;
+            }
+            if (j < placed) {
+                break;
+            }
+            slots[placed] = slot;
+        }
+        if (placed == size) {
+            for (Py_ssize_t i = 0; i < size; i++) {
+                taken[slots[i] >> 3] |= 1 << (slots[i] & 7);
+                table[slots[i]] = bucket[i];
+            }
+            pilots[perfect_bucket(mix(bucket[0].hash), buckets)] = pilot;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+static int
+optimize(FAMObject *self)
+{
+    // Replace our table with a perfect hash over our stored hashes, in the
+    // style of CHD and PTHash. Keys are split into buckets of about four by
+    // their hash. Then, biggest buckets first, we search for a "pilot" for
+    // each bucket that scatters its keys into free slots of the new table.
+    // Lookups then take one probe, and the table shrinks from (up to)
+    // 2n / LOAD + SCAN - 1 entries to n + n / 32 + 1 (the last one being an
+    // empty sentinel for misses). It isn't quite minimal: with no slack at
+    // all, placing the last few keys takes about n tries each. We don't touch
+    // self until we've succeeded. Returns 1 on success, 0 if the hashes can't
+    // be separated (leaving our table alone), and -1 on error.
+    Py_ssize_t size = self->keys_size;
+    Py_ssize_t tablesize = size + size / 32;
+    if ((uint64_t)tablesize >= 0xFFFFFFFF) {
+        // reduce() only has 32 bits to work with.
+        return 0;
+    }
+    Py_ssize_t buckets = size / 4 + 1;
+    entry *sorted = PyMem_Malloc((size + 1) * sizeof(entry));
+    Py_ssize_t *starts = PyMem_Calloc(buckets + 1, sizeof(Py_ssize_t));
+    Py_ssize_t *order = PyMem_Malloc(buckets * sizeof(Py_ssize_t));
+    Py_ssize_t *slots = PyMem_Malloc((size + 1) * sizeof(Py_ssize_t));
+    uint16_t *pilots = PyMem_Calloc(buckets, sizeof(uint16_t));
+    uint8_t *taken = PyMem_Calloc(tablesize / 8 + 1, 1);
+    entry *table = table_new(tablesize + 1);
+    int result = -1;
+    if (!sorted || !starts || !order || !slots || !pilots || !taken || !table)
+    {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < tablesize + 1; i++) {
+        table[i].index = -1;
+        table[i].hash = -1;
+    }
+    // Counting sort our entries by bucket (skipping any a snapshot can't see):
+    entry *old = self->table;
+    Py_ssize_t oldlength = table_length(self);
+    for (Py_ssize_t i = 0; i < oldlength; i++) {
+        if (old[i].hash != -1 && old[i].index < size) {
+            starts[perfect_bucket(mix(old[i].hash), buckets) + 1]++;
+        }
+    }
+    Py_ssize_t biggest = 0;
+    for (Py_ssize_t b = 0; b < buckets; b++) {
+        biggest = Py_MAX(biggest, starts[b + 1]);
+        starts[b + 1] += starts[b];
+    }
+    for (Py_ssize_t i = 0; i < oldlength; i++) {
+        if (old[i].hash != -1 && old[i].index < size) {
+            sorted[starts[perfect_bucket(mix(old[i].hash), buckets)]++] =
+                old[i];
+        }
+    }
+    // That left each start pointing at the next bucket, so shift them back:
+    memmove(starts + 1, starts, buckets * sizeof(Py_ssize_t));
+    starts[0] = 0;
+    // Now counting sort the buckets, biggest first:
+    Py_ssize_t *sizes = PyMem_Calloc(biggest + 2, sizeof(Py_ssize_t));
+    if (!sizes) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (Py_ssize_t b = 0; b < buckets; b++) {
+        sizes[biggest - (starts[b + 1] - starts[b]) + 1]++;
+    }
+    for (Py_ssize_t k = 0; k <= biggest; k++) {
+        sizes[k + 1] += sizes[k];
+    }
+    for (Py_ssize_t b = 0; b < buckets; b++) {
+        order[sizes[biggest - (starts[b + 1] - starts[b])]++] = b;
+    }
+    PyMem_Free(sizes);
+    result = 1;
+    for (Py_ssize_t i = 0; i < buckets; i++) {
+        Py_ssize_t b = order[i];
+        Py_ssize_t bucketsize = starts[b + 1] - starts[b];
+        if (!bucketsize) {
+            break;
+        }
+        if (place_bucket(pilots, buckets, sorted + starts[b], bucketsize,
+                         slots, taken, table, tablesize))
+        {
+            result = 0;
+            break;
+        }
+    }
+    if (result) {
+        release(self->table, self->tablerefs);
+        self->tablerefs = NULL;
+        self->table = table;
+        self->tablesize = tablesize;
+        self->pilots = pilots;
+        self->buckets = buckets;
+        table = NULL;
+        pilots = NULL;
+    }
+done:
+    PyMem_Free(sorted);
+    PyMem_Free(starts);
+    PyMem_Free(order);
+    PyMem_Free(slots);
+    PyMem_Free(pilots);
+    PyMem_Free(taken);
+    table_free(table);
+    return result;
+}
+
+
+static PyObject *
+fam_optimize(FAMObject *self)
+{
+    if (PyObject_TypeCheck(self, &AMType)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "AutoMap can't be optimized; freeze() it first");
+        return NULL;
+    }
+    if (self->sorted) {
+        // There's no table to optimize.
+        Py_RETURN_FALSE;
+    }
+    if (build(self)) {
+        return NULL;
+    }
+    if (self->pilots) {
+        Py_RETURN_TRUE;
+    }
+    int result = optimize(self);
+    if (result < 0) {
+        return NULL;
+    }
+    return PyBool_FromLong(result);
+}
+
+
+static PyObject *
+fail_arrow(PyObject *capsules, FAMObject *self)
+{
+    // Dropping the capsules can call the producer's release callbacks, which
+    // may run Python code. That isn't allowed with an exception set:
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    Py_XDECREF(self);
+    Py_DECREF(capsules);
+    PyErr_Restore(type, value, traceback);
+    return NULL;
+}
+
+
+static int
+check_offsets(const char *offsets, int large, int64_t length, const char *data)
+{
+    // The C data interface doesn't say how long the buffers are, so all we can
+    // do is make sure that the offsets never point before the data or go
+    // backward. The last one then marks the end of what we'll ever read:
+    int64_t last = 0;
+    for (int64_t i = 0; i <= length; i++) {
+        int64_t offset = large ? ((const int64_t *)offsets)[i]
+                               : ((const int32_t *)offsets)[i];
+        if (offset < last) {
+            PyErr_Format(PyExc_ValueError,
+                         "invalid Arrow string offset %lld at index %lld",
+                         (long long)offset, (long long)i);
+            return -1;
+        }
+        last = offset;
+    }
+    if (PY_SSIZE_T_MAX < last || (last && !data)) {
+        PyErr_SetString(PyExc_ValueError, "invalid Arrow string data");
+        return -1;
+    }
+    return 0;
+}
+
+
+static PyObject *
+fam_from_arrow(PyTypeObject *cls, PyObject *array)
+{
+    // Build a map directly over an Arrow string or large_string array, using
+    // the Arrow PyCapsule Interface. The keys are hashed and compared as UTF-8
+    // bytes, and stay in Arrow's buffers instead of becoming str objects.
+    PyObject *capsules = PyObject_CallMethod(array, "__arrow_c_array__", NULL);
+    if (!capsules) {
+        return NULL;
+    }
+    if (!PyTuple_Check(capsules) || PyTuple_GET_SIZE(capsules) != 2) {
+        PyErr_SetString(PyExc_TypeError,
+                        "__arrow_c_array__ must return a (schema, array) "
+                        "tuple");
+        return fail_arrow(capsules, NULL);
+    }
+    PyObject *owner = PyTuple_GET_ITEM(capsules, 1);
+    struct ArrowSchema *schema = PyCapsule_GetPointer(
+        PyTuple_GET_ITEM(capsules, 0), "arrow_schema");
+    struct ArrowArray *arrow = PyCapsule_GetPointer(owner, "arrow_array");
+    if (!schema || !arrow) {
+        return fail_arrow(capsules, NULL);
+    }
+    int large = !strcmp(schema->format, "U");
+    if (!large && strcmp(schema->format, "u")) {
+        PyErr_Format(PyExc_TypeError,
+                     "expected an Arrow string or large_string array, got "
+                     "format '%s'", schema->format);
+        return fail_arrow(capsules, NULL);
+    }
+    if (!arrow->release || arrow->n_buffers != 3 || arrow->offset < 0 ||
+        arrow->length < 0 || PY_SSIZE_T_MAX <= arrow->length ||
+        (arrow->length && !arrow->buffers[1]))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid Arrow array");
+        return fail_arrow(capsules, NULL);
+    }
+    const uint8_t *validity = arrow->buffers[0];
+    if (arrow->null_count && validity) {
+        int64_t stop = arrow->offset + arrow->length;
+        for (int64_t i = arrow->offset; i < stop; i++) {
+            if (!(validity[i >> 3] >> (i & 7) & 1)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "Arrow array must not contain nulls");
+                return fail_arrow(capsules, NULL);
+            }
+        }
+    }
+    // Empty arrays are allowed to omit their buffers:
+    static const int64_t nooffsets[1] = {0};
+    const char *offsets = arrow->buffers[1];
+    const char *data = arrow->buffers[2];
+    offsets = offsets ? offsets + arrow->offset * (large ? 8 : 4) :
+                        (const char *)nooffsets;
+    if (check_offsets(offsets, large, arrow->length, data)) {
+        return fail_arrow(capsules, NULL);
+    }
+    FAMObject *self = (FAMObject *)FAMType.tp_alloc(&FAMType, 0);
+    if (!self) {
+        return fail_arrow(capsules, NULL);
+    }
+    Py_INCREF(owner);
+    self->strings = owner;
+    self->offsets = offsets;
+    self->data = data ? data : "";
+    self->large = large;
+    self->keys_size = arrow->length;
+    count += self->keys_size;
+    if (build(self)) {
+        return fail_arrow(capsules, self);
+    }
+    Py_DECREF(capsules);
+    if (cls == &FAMType) {
+        return (PyObject *)self;
+    }
+    // Anything else (like an AutoMap) gets its own copy of the keys:
+    FAMObject *new = copy(cls, self, self->keys_size);
+    if (!new) {
+        return fail_arrow((PyObject *)self, NULL);
+    }
+    Py_DECREF(self);
+    return (PyObject *)new;
+}
+
+
+static PyMethodDef fam_methods[] = {
+    {"__getnewargs_ex__", (PyCFunction) fam___getnewargs_ex__, METH_NOARGS,
+     NULL},
+    {"__reversed__", (PyCFunction) fam___reversed__, METH_NOARGS, NULL},
+    {"__sizeof__", (PyCFunction) fam___sizeof__, METH_NOARGS, NULL},
+    {"from_arrow", (PyCFunction) fam_from_arrow, METH_O | METH_CLASS, NULL},
+    {"get", (PyCFunction) fam_get, METH_FASTCALL, NULL},
+    {"get_indexer", (PyCFunction) fam_get_indexer, METH_O, NULL},
+    {"items", (PyCFunction) fam_items, METH_NOARGS, NULL},
+    {"keys", (PyCFunction) fam_keys, METH_NOARGS, NULL},
+    {"optimize", (PyCFunction) fam_optimize, METH_NOARGS, NULL},
+    {"slice_locs", (PyCFunction) fam_slice_locs, METH_FASTCALL, NULL},
+    {"values", (PyCFunction) fam_values, METH_NOARGS, NULL},
+    {NULL},
+};
+
+
+typedef struct {
+    int bloom;
+    int lazy;
+    int sorted;
+} options;
+
+
+static int
+parse_option(const char *name, PyObject *keyword, PyObject *value,
+             options *opts)
+{
+    int *option = NULL;
+    if (!PyUnicode_CompareWithASCIIString(keyword, "bloom")) {
+        option = &opts->bloom;
+    }
+    else if (!PyUnicode_CompareWithASCIIString(keyword, "lazy")) {
+        option = &opts->lazy;
+    }
+    else if (!PyUnicode_CompareWithASCIIString(keyword, "sorted")) {
+        option = &opts->sorted;
+    }
+    if (!option) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s got an unexpected keyword argument %R", name, keyword);
+        return -1;
+    }
+    *option = PyObject_IsTrue(value);
+    return *option < 0 ? -1 : 0;
+}
+
+
+static PyObject *
+new_sorted(PyTypeObject *cls, PyObject *keys)
+{
+    // Sorted maps store their keys as int64s, with no table at all. They have
+    // to be strictly increasing integers, which also makes them unique.
+    if (PyType_IsSubtype(cls, &AMType)) {
+        PyErr_SetString(PyExc_TypeError, "AutoMap can't be sorted");
+        return NULL;
+    }
+    keys = keys ?
+           PySequence_Fast(keys, "expected an iterable of keys") :
+           PyTuple_New(0);
+    if (!keys) {
+        return NULL;
+    }
+    Py_ssize_t size = PySequence_Fast_GET_SIZE(keys);
+    int64_t *sorted = PyMem_Malloc(Py_MAX(size, 1) * sizeof(int64_t));
+    if (!sorted) {
+        Py_DECREF(keys);
+        return PyErr_NoMemory();
+    }
+    for (Py_ssize_t i = 0; i < size; i++) {
+        PyObject *key = PySequence_Fast_GET_ITEM(keys, i);
+        PyObject *integer = PyNumber_Index(key);
+        if (!integer) {
+            goto error;
+        }
+        sorted[i] = PyLong_AsLongLong(integer);
+        Py_DECREF(integer);
+        if (sorted[i] == -1 && PyErr_Occurred()) {
+            goto error;
+        }
+        if (i && sorted[i] <= sorted[i - 1]) {
+            if (sorted[i] == sorted[i - 1]) {
+                set_key_error(NonUniqueError, key);
+            }
+            else {
+                PyErr_SetString(PyExc_ValueError,
+                                "sorted keys must be in increasing order");
+            }
+            goto error;
+        }
+    }
+    Py_DECREF(keys);
+    if (fill_intcache(size)) {
+        PyMem_Free(sorted);
+        return NULL;
+    }
+    FAMObject *self = (FAMObject *)cls->tp_alloc(cls, 0);
+    if (!self) {
+        PyMem_Free(sorted);
+        return NULL;
+    }
+    self->sorted = sorted;
+    self->keys_size = size;
+    count += size;
+    return (PyObject *)self;
+error:
+    Py_DECREF(keys);
+    PyMem_Free(sorted);
+    return NULL;
+}
+
+
+static PyObject *
+new(PyTypeObject *cls, PyObject *keys, options *opts)
+{
+    if (opts->sorted) {
+        if (opts->bloom) {
+            PyErr_SetString(PyExc_ValueError,
+                            "sorted maps can't have a bloom filter");
+            return NULL;
+        }
+        return new_sorted(cls, keys);
+    }
+    if (!keys) {
+        keys = PyList_New(0);
+    }
+    else if (PyObject_TypeCheck(keys, &FAMType) &&
+             (!opts->bloom || ((FAMObject *)keys)->filtered))
+    {
+        if (!PyType_IsSubtype(cls, &AMType) &&
+            !PyObject_TypeCheck(keys, &AMType))
+        {
+            Py_INCREF(keys);
+            return keys;
+        }
+        return (PyObject *)copy(cls, (FAMObject *)keys,
+                                ((FAMObject *)keys)->keys_size);
+    }
+    else {
+        keys = PySequence_List(keys);
+    }
+    if (!keys) {
+        return NULL;
+    }
+    FAMObject *self = (FAMObject *)cls->tp_alloc(cls, 0);
+    if (!self) {
+        Py_DECREF(keys);
+        return NULL;
+    }
+    self->keys = keys;
+    self->keys_size = PyList_GET_SIZE(keys);
+    self->filtered = opts->bloom;
+    count += self->keys_size;
+    // Lazy maps still need the intcache for iterating over their values:
+    if (opts->lazy ? fill_intcache(self->keys_size) : build(self)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    // Frozen maps can never grow, so don't keep any room for it:
+    if (!PyType_IsSubtype(cls, &AMType) && trim(keys)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
 
 
 static PyObject *
-get(FAMObject *self, PyObject *key, PyObject *missing) {
-    Py_ssize_t result = lookup(self, key);
-    if (result < 0) {
-        if (PyErr_Occurred()) {
+fam_new(PyTypeObject *cls, PyObject *args, PyObject *kwargs)
+{
+    const char *name = cls->tp_name;
+    options opts = {0};
+    PyObject *keyword, *value;
+    Py_ssize_t position = 0;
+    while (kwargs && PyDict_Next(kwargs, &position, &keyword, &value)) {
+        if (parse_option(name, keyword, value, &opts)) {
             return NULL;
         }
-        if (missing) {
-            Py_INCREF(missing);
-            return missing;
+    }
+    PyObject *keys = NULL;
+    if (!PyArg_UnpackTuple(args, name, 0, 1, &keys)) {
+        return NULL;
+    }
+    return new(cls, keys, &opts);
+}
+
+
+// Calling a type through tp_vectorcall (rather than tp_new) skips packing the
+// arguments into a tuple. It's only supported on 3.9+:
+
+# if PY_VERSION_HEX >= 0x03090000
+
+static PyObject *
+fam_vectorcall(PyTypeObject *cls, PyObject *const *args, size_t nargsf,
+               PyObject *kwnames)
+{
+    const char *name = cls->tp_name;
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    if (1 < nargs) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s expected at most 1 argument, got %zd", name, nargs);
+        return NULL;
+    }
+    options opts = {0};
+    Py_ssize_t nkwargs = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    for (Py_ssize_t i = 0; i < nkwargs; i++) {
+        if (parse_option(name, PyTuple_GET_ITEM(kwnames, i), args[nargs + i],
+                         &opts))
+        {
+            return NULL;
         }
-        PyErr_SetObject(PyExc_KeyError, key);
+    }
+    return new(cls, nargs ? args[0] : NULL, &opts);
+}
+
+# endif
+
+
+static PyObject *
+fam_repr(FAMObject *self)
+{
+    PyObject *keys = keys_list(self);
+    if (!keys) {
         return NULL;
     }
-    PyObject *index = PyList_GET_ITEM(intcache, result);
-    Py_INCREF(index);
-    return index;
+    PyObject *repr = PyUnicode_FromFormat("%s(%R)", Py_TYPE(self)->tp_name,
+                                          keys);
+    Py_DECREF(keys);
+    return repr;
 }
 
 
 static PyObject *
-fam_subscript(FAMObject *self, PyObject *key)
+fam_richcompare(FAMObject *self, PyObject *other, int op)
 {
-    return get(self, key, NULL);
+    if (!PyObject_TypeCheck(other, &FAMType)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    PyObject *left = keys_list(self);
+    if (!left) {
+        return NULL;
+    }
+    PyObject *right = keys_list((FAMObject *)other);
+    if (!right) {
+        Py_DECREF(left);
+        return NULL;
+    }
+    PyObject *result = PyObject_RichCompare(left, right, op);
+    Py_DECREF(left);
+    Py_DECREF(right);
+    return result;
 }
 
 
-static PyMappingMethods fam_as_mapping = {
-    .mp_length = (lenfunc) fam_length,
-    .mp_subscript = (binaryfunc) fam_subscript,
+static PyTypeObject FAMType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_as_mapping = &fam_as_mapping,
+    .tp_as_number = &fam_as_number,
+    .tp_as_sequence = &fam_as_sequence,
+    .tp_basicsize = sizeof(FAMObject),
+    .tp_dealloc = (destructor) fam_dealloc,
+    .tp_doc = "An immutable autoincremented integer-valued mapping.",
+    .tp_hash = (hashfunc) fam_hash,
+    .tp_iter = (getiterfunc) fam_iter,
+    .tp_methods = fam_methods,
+    .tp_name = "automap.FrozenAutoMap",
+    .tp_new = fam_new,
+    .tp_repr = (reprfunc) fam_repr,
+    .tp_richcompare = (richcmpfunc) fam_richcompare,
+# if PY_VERSION_HEX >= 0x03090000
+    .tp_vectorcall = (vectorcallfunc) fam_vectorcall,
+# endif
 };
 
 
 static PyObject *
-fam_or(PyObject *left, PyObject *right)
+am_inplace_or(FAMObject *self, PyObject *other)
 {
-    if (!PyObject_TypeCheck(left, &FAMType) ||
-        !PyObject_TypeCheck(right, &FAMType)
-    ) {
-        Py_RETURN_NOTIMPLEMENTED;
+    if (extend(self, other)) {
+        return NULL;
     }
-    FAMObject *updated = copy(Py_TYPE(left), (FAMObject *)left);
-    if (!updated) {
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+
+static PyNumberMethods am_as_number = {
+    .nb_inplace_or = (binaryfunc) am_inplace_or,
+};
+
+
+static PyObject *
+am_add(FAMObject *self, PyObject *other)
+{
+    if (append(self, other)) {
         return NULL;
     }
-    if (extend(updated, ((FAMObject *)right)->keys)) {
-        Py_DECREF(updated);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+am_update(FAMObject *self, PyObject *other)
+{
+    if (extend(self, other)) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+am_freeze(FAMObject *self)
+{
+    // Move our keys and table into a new FrozenAutoMap, leaving ourselves
+    // empty. Usually this is O(1), but an update() that failed partway through
+    // can leave us with more keys capacity and table than we need, so fit()
+    // those first:
+    if (fit(self)) {
+        return NULL;
+    }
+    PyObject *keys = PyList_New(0);
+    if (!keys) {
+        return NULL;
+    }
+    FAMObject *frozen = (FAMObject *)FAMType.tp_alloc(&FAMType, 0);
+    if (!frozen) {
+        Py_DECREF(keys);
+        return NULL;
+    }
+    frozen->keys = keys;
+    frozen->filtered = self->filtered;
+    if (grow(frozen, 0)) {
+        Py_DECREF(frozen);
+        return NULL;
+    }
+    entry *table = frozen->table;
+    Py_ssize_t tablesize = frozen->tablesize;
+    uint64_t *filter = frozen->filter;
+    Py_ssize_t filterblocks = frozen->filterblocks;
+    frozen->keys = self->keys;
+    frozen->keys_size = self->keys_size;
+    frozen->table = self->table;
+    frozen->tablesize = self->tablesize;
+    frozen->tablerefs = self->tablerefs;
+    frozen->filter = self->filter;
+    frozen->filterblocks = self->filterblocks;
+    self->keys = keys;
+    self->keys_size = 0;
+    self->table = table;
+    self->tablesize = tablesize;
+    self->tablerefs = NULL;
+    self->filter = filter;
+    self->filterblocks = filterblocks;
+    return (PyObject *)frozen;
+}
+
+
+static PyObject *
+am_shrink_to_fit(FAMObject *self)
+{
+    if (fit(self)) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+am_snapshot(FAMObject *self)
+{
+    // Return a FrozenAutoMap sharing our keys and table in O(1). We only ever
+    // append to either, so the snapshot just needs to remember how many keys it
+    // has and ignore the rest. When we outgrow the table, grow() leaves the old
+    // one behind for any snapshots still using it.
+    if (build(self)) {
+        return NULL;
+    }
+    if (!self->tablerefs) {
+        self->tablerefs = PyMem_New(Py_ssize_t, 1);
+        if (!self->tablerefs) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        *self->tablerefs = 1;
+    }
+    FAMObject *snapshot = (FAMObject *)FAMType.tp_alloc(&FAMType, 0);
+    if (!snapshot) {
+        return NULL;
+    }
+    Py_INCREF(self->keys);
+    snapshot->keys = self->keys;
+    snapshot->keys_size = self->keys_size;
+    snapshot->table = self->table;
+    snapshot->tablesize = self->tablesize;
+    snapshot->tablerefs = self->tablerefs;
+    ++*self->tablerefs;
+    count += snapshot->keys_size;
+    return (PyObject *)snapshot;
+}
+
+
+static PyMethodDef am_methods[] = {
+    {"add", (PyCFunction) am_add, METH_O, NULL},
+    {"freeze", (PyCFunction) am_freeze, METH_NOARGS, NULL},
+    {"shrink_to_fit", (PyCFunction) am_shrink_to_fit, METH_NOARGS, NULL},
+    {"snapshot", (PyCFunction) am_snapshot, METH_NOARGS, NULL},
+    {"update", (PyCFunction) am_update, METH_O, NULL},
+    {NULL},
+};
+
+
+static PyTypeObject AMType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_as_number = &am_as_number,
+    .tp_base = &FAMType,
+    .tp_doc = "A grow-only autoincremented integer-valued mapping.",
+    .tp_methods = am_methods,
+    .tp_name = "automap.AutoMap",
+    .tp_richcompare = (richcmpfunc) fam_richcompare,
+# if PY_VERSION_HEX >= 0x03090000
+    .tp_vectorcall = (vectorcallfunc) fam_vectorcall,
+# endif
+};
+
+
+/*******************************************************************************
+
+FrozenCompositeAutoMap is a FrozenAutoMap whose keys are rows of several
+parallel columns, like a hierarchical (multi-level) index. It could be emulated
+with a FrozenAutoMap of tuples, but that means allocating and hashing a tuple
+for every row, and again for every lookup. Instead, we store each column as its
+own list, combine the per-column hashes directly (the same way tuples do), and
+compare rows column by column. The table itself is the same as FrozenAutoMap's.
+
+*******************************************************************************/
+
+
+typedef struct {
+    PyObject_VAR_HEAD
+    Py_ssize_t tablesize;
+    entry *table;
+    PyObject *columns;
+    Py_ssize_t depth;
+    Py_ssize_t keys_size;
+} FCAMObject;
+
+
+static PyTypeObject FCAMType;
+
+
+// These are the xxHash-based constants that tuples use to combine hashes:
+
+# if SIZEOF_PY_HASH_T > 4
+# define XXPRIME_1 ((Py_uhash_t)11400714785074694791ULL)
+# define XXPRIME_2 ((Py_uhash_t)14029467366897019727ULL)
+# define XXPRIME_5 ((Py_uhash_t)2870177450012600261ULL)
+# define XXROTATE(x) ((x << 31) | (x >> 33))
+# else
+# define XXPRIME_1 ((Py_uhash_t)2654435761UL)
+# define XXPRIME_2 ((Py_uhash_t)2246822519UL)
+# define XXPRIME_5 ((Py_uhash_t)374761393UL)
+# define XXROTATE(x) ((x << 13) | (x >> 19))
+# endif
+
+
+static Py_hash_t
+hash_row(PyObject *const *row, Py_ssize_t depth)
+{
+    Py_uhash_t acc = XXPRIME_5;
+    for (Py_ssize_t i = 0; i < depth; i++) {
+        Py_uhash_t lane = PyObject_Hash(row[i]);
+        if (lane == (Py_uhash_t)-1) {
+            return -1;
+        }
+        acc += lane * XXPRIME_2;
+        acc = XXROTATE(acc);
+        acc *= XXPRIME_1;
+    }
+    acc += depth ^ (XXPRIME_5 ^ 3527539UL);
+    if (acc == (Py_uhash_t)-1) {
+        return 1546275796;
+    }
+    return acc;
+}
+
+
+static PyObject *
+row_tuple(PyObject *const *row, Py_ssize_t depth)
+{
+    PyObject *tuple = PyTuple_New(depth);
+    if (!tuple) {
+        return NULL;
+    }
+    for (Py_ssize_t level = 0; level < depth; level++) {
+        Py_INCREF(row[level]);
+        PyTuple_SET_ITEM(tuple, level, row[level]);
+    }
+    return tuple;
+}
+
+
+typedef struct {
+    FCAMObject *self;
+    PyObject *const *row;
+} rowkey;
+
+
+static int
+match_row(const void *context, Py_ssize_t offset)
+{
+    const rowkey *k = context;
+    for (Py_ssize_t level = 0; level < k->self->depth; level++) {
+        PyObject *column = PyTuple_GET_ITEM(k->self->columns, level);
+        PyObject *guess = PyList_GET_ITEM(column, offset);
+        if (guess == k->row[level]) {
+            continue;
+        }
+        int result = PyObject_RichCompareBool(guess, k->row[level], Py_EQ);
+        if (result <= 0) {
+            return result;
+        }
+    }
+    return 1;
+}
+
+
+static Py_ssize_t
+fcam_lookup_hash(FCAMObject *self, PyObject *const *row, Py_hash_t hash)
+{
+    rowkey k = {self, row};
+    return probe(self->table, self->tablesize, hash, match_row, &k);
+}
+
+
+static Py_ssize_t
+fcam_lookup(FCAMObject *self, PyObject *const *row)
+{
+    Py_hash_t hash = hash_row(row, self->depth);
+    if (hash == -1) {
+        return -1;
+    }
+    Py_ssize_t index = fcam_lookup_hash(self, row, hash);
+    if (index < 0) {
+        return -1;
+    }
+    return self->table[index].index;
+}
+
+
+static int
+fcam_row(FCAMObject *self, PyObject *const *key, PyObject *const **row)
+{
+    // Unpack a key passed as a single object into a row. Returns 0 if it can't
+    // possibly be one of our keys. With only one level, the key is the row:
+    if (self->depth == 1) {
+        *row = key;
+        return 1;
+    }
+    if (!PyTuple_Check(*key) || PyTuple_GET_SIZE(*key) != self->depth) {
+        return 0;
+    }
+    *row = PySequence_Fast_ITEMS(*key);
+    return 1;
+}
+
+
+static Py_ssize_t
+fcam_length(FCAMObject *self)
+{
+    return self->keys_size;
+}
+
+
+static PyObject *
+fcam_subscript(FCAMObject *self, PyObject *key)
+{
+    PyObject *const *row;
+    Py_ssize_t result = -1;
+    if (fcam_row(self, &key, &row)) {
+        result = fcam_lookup(self, row);
+    }
+    if (result < 0) {
+        if (!PyErr_Occurred()) {
+            set_key_error(PyExc_KeyError, key);
+        }
         return NULL;
     }
-    return (PyObject *)updated;
+    PyObject *index = PyList_GET_ITEM(intcache, result);
+    Py_INCREF(index);
+    return index;
 }
 
 
-static PyNumberMethods fam_as_number = {
-    .nb_or = (binaryfunc) fam_or,
+static PyMappingMethods fcam_as_mapping = {
+    .mp_length = (lenfunc) fcam_length,
+    .mp_subscript = (binaryfunc) fcam_subscript,
 };
 
 
 static int
-fam_contains(FAMObject *self, PyObject *key)
+fcam_contains(FCAMObject *self, PyObject *key)
 {
-    if (lookup(self, key) < 0) {
+    PyObject *const *row;
+    if (!fcam_row(self, &key, &row)) {
+        return 0;
+    }
+    if (fcam_lookup(self, row) < 0) {
         if (PyErr_Occurred()) {
             return -1;
         }
@@ -740,30 +3312,23 @@ fam_contains(FAMObject *self, PyObject *key)
 }
 
 
-static PySequenceMethods fam_as_sequence = {
-    .sq_contains = (objobjproc) fam_contains,
+static PySequenceMethods fcam_as_sequence = {
+    .sq_contains = (objobjproc) fcam_contains,
 };
 
 
 static void
-fam_dealloc(FAMObject *self)
+fcam_dealloc(FCAMObject *self)
 {
-    PyMem_Del(self->table);
-    count -= PyList_GET_SIZE(self->keys);
-    Py_DECREF(self->keys);
-    if (!count) {
-        Py_CLEAR(intcache);
-    }
-    else if (count < PyList_GET_SIZE(intcache)) {
-        // del intcache[count:]
-        PyList_SetSlice(intcache, count, PyList_GET_SIZE(intcache), NULL);
-    }
+    table_free(self->table);
+    discount(self->keys_size);
+    Py_XDECREF(self->columns);
     Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
 
 static Py_hash_t
-fam_hash(FAMObject *self)
+fcam_hash(FCAMObject *self)
 {
     Py_hash_t hash = 0;
     for (Py_ssize_t i = 0; i < self->tablesize; i++) {
@@ -777,234 +3342,585 @@ fam_hash(FAMObject *self)
 
 
 static PyObject *
-fam_iter(FAMObject *self)
+fcam_iter(FCAMObject *self)
 {
-    return iter(self, KEYS, 0);
+    // zip(*columns) already yields rows as tuples (and recycles them, too).
+    // With only one level, the keys are the column's items themselves:
+    if (self->depth == 1) {
+        return PyObject_GetIter(PyTuple_GET_ITEM(self->columns, 0));
+    }
+    PyObject *zip = PyObject_Call((PyObject *)&PyZip_Type, self->columns, NULL);
+    if (!zip) {
+        return NULL;
+    }
+    PyObject *iterator = PyObject_GetIter(zip);
+    Py_DECREF(zip);
+    return iterator;
+}
+
+
+static PyObject *
+fcam___reversed__(FCAMObject *self)
+{
+    // zip(*map(reversed, columns)), or just the one column reversed:
+    if (self->depth == 1) {
+        return PyObject_CallMethod(PyTuple_GET_ITEM(self->columns, 0),
+                                   "__reversed__", NULL);
+    }
+    PyObject *reversers = PyTuple_New(self->depth);
+    if (!reversers) {
+        return NULL;
+    }
+    for (Py_ssize_t level = 0; level < self->depth; level++) {
+        PyObject *column = PyTuple_GET_ITEM(self->columns, level);
+        PyObject *reverser = PyObject_CallMethod(column, "__reversed__", NULL);
+        if (!reverser) {
+            Py_DECREF(reversers);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(reversers, level, reverser);
+    }
+    PyObject *zip = PyObject_Call((PyObject *)&PyZip_Type, reversers, NULL);
+    Py_DECREF(reversers);
+    return zip;
 }
 
 
 static PyObject *
-fam___getnewargs__(FAMObject *self)
+fcam___getnewargs__(FCAMObject *self)
 {
-    return PyTuple_Pack(1, self->keys);
+    Py_INCREF(self->columns);
+    return self->columns;
 }
 
 
 static PyObject *
-fam___reversed__(FAMObject *self)
+fcam___sizeof__(FCAMObject *self)
 {
-    return iter(self, KEYS, 1);
+    // Our own footprint, plus the columns tuple and each of the lists in it:
+    Py_ssize_t size = Py_TYPE(self)->tp_basicsize
+                      + (self->tablesize + SCAN - 1) * sizeof(entry);
+    for (Py_ssize_t level = -1; level < self->depth; level++) {
+        PyObject *object = level < 0 ? self->columns
+                                     : PyTuple_GET_ITEM(self->columns, level);
+        PyObject *objectsizeof = PyObject_CallMethod(object, "__sizeof__",
+                                                     NULL);
+        if (!objectsizeof) {
+            return NULL;
+        }
+        Py_ssize_t bytes = PyLong_AsSsize_t(objectsizeof);
+        Py_DECREF(objectsizeof);
+        if (bytes == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        size += bytes;
+    }
+    return PyLong_FromSsize_t(size);
 }
 
 
 static PyObject *
-fam___sizeof__(FAMObject *self)
+fcam_get_loc(FCAMObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
-    PyObject *listsizeof = PyObject_CallMethod(self->keys, "__sizeof__", NULL);
-    if (!listsizeof) {
+    // Look up a row passed as one argument per level, without building a tuple:
+    if (nargs != self->depth) {
+        PyErr_Format(PyExc_TypeError, "get_loc expected %zd arguments, got %zd",
+                     self->depth, nargs);
         return NULL;
     }
-    Py_ssize_t listbytes = PyLong_AsSsize_t(listsizeof);
-    Py_DECREF(listsizeof);
-    if (listbytes == -1 && PyErr_Occurred()) {
+    Py_ssize_t result = fcam_lookup(self, args);
+    if (result < 0) {
+        if (!PyErr_Occurred()) {
+            PyObject *key = row_tuple(args, nargs);
+            if (key) {
+                set_key_error(PyExc_KeyError, key);
+                Py_DECREF(key);
+            }
+        }
         return NULL;
     }
-    return PyLong_FromSsize_t(
-        Py_TYPE(self)->tp_basicsize
-        + listbytes
-        + (self->tablesize + SCAN - 1) * sizeof(entry)
-    );
+    PyObject *index = PyList_GET_ITEM(intcache, result);
+    Py_INCREF(index);
+    return index;
 }
 
 
 static PyObject *
-fam_get(FAMObject *self, PyObject *args)
+fcam_get(FCAMObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
-    PyObject *key, *missing = Py_None;
-    if (!PyArg_UnpackTuple(args, Py_TYPE(self)->tp_name, 1, 2, &key, &missing))
-    {
+    if (nargs != 1 && nargs != 2) {
+        PyErr_Format(PyExc_TypeError, "get expected 1 or 2 arguments, got %zd",
+                     nargs);
+        return NULL;
+    }
+    PyObject *const *row;
+    Py_ssize_t result = -1;
+    if (fcam_row(self, args, &row)) {
+        result = fcam_lookup(self, row);
+    }
+    if (result < 0) {
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        PyObject *missing = nargs == 2 ? args[1] : Py_None;
+        Py_INCREF(missing);
+        return missing;
+    }
+    PyObject *index = PyList_GET_ITEM(intcache, result);
+    Py_INCREF(index);
+    return index;
+}
+
+
+static PyObject *
+fcam_view(FCAMObject *self, const char *name)
+{
+    // Our rows don't exist as objects until they're asked for, so rather than
+    // FrozenAutoMapView, use the generic views from collections.abc. They only
+    // need len(), iter(), in, and []:
+    PyObject *abc = PyImport_ImportModule("collections.abc");
+    if (!abc) {
         return NULL;
     }
-    return get(self, key, missing);
+    PyObject *view = PyObject_CallMethod(abc, name, "O", self);
+    Py_DECREF(abc);
+    return view;
 }
 
 
 static PyObject *
-fam_items(FAMObject *self)
+fcam_items(FCAMObject *self)
 {
-    return view(self, ITEMS);
+    return fcam_view(self, "ItemsView");
 }
 
 
 static PyObject *
-fam_keys(FAMObject *self)
+fcam_keys(FCAMObject *self)
 {
-    return view(self, KEYS);
+    return fcam_view(self, "KeysView");
 }
 
 
 static PyObject *
-fam_values(FAMObject *self)
+fcam_values(FCAMObject *self)
 {
-    return view(self, VALUES);
+    return fcam_view(self, "ValuesView");
 }
 
 
-static PyMethodDef fam_methods[] = {
-    {"__getnewargs__", (PyCFunction) fam___getnewargs__, METH_NOARGS, NULL},
-    {"__reversed__", (PyCFunction) fam___reversed__, METH_NOARGS, NULL},
-    {"__sizeof__", (PyCFunction) fam___sizeof__, METH_NOARGS, NULL},
-    {"get", (PyCFunction) fam_get, METH_VARARGS, NULL},
-    {"items", (PyCFunction) fam_items, METH_NOARGS, NULL},
-    {"keys", (PyCFunction) fam_keys, METH_NOARGS, NULL},
-    {"values", (PyCFunction) fam_values, METH_NOARGS, NULL},
+static PyObject *
+fcam_get_indexer(FCAMObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    // Look up many rows at once, passed as one column per level. Like
+    // FrozenAutoMap.get_indexer, the result is a memoryview of int64 positions,
+    // with -1 for missing rows.
+    if (nargs != self->depth) {
+        PyErr_Format(PyExc_TypeError,
+                     "get_indexer expected %zd arguments, got %zd",
+                     self->depth, nargs);
+        return NULL;
+    }
+    PyObject *columns = PyTuple_New(nargs);
+    if (!columns) {
+        return NULL;
+    }
+    PyObject **rowbuffer = PyMem_New(PyObject *, nargs);
+    if (!rowbuffer) {
+        Py_DECREF(columns);
+        return PyErr_NoMemory();
+    }
+    Py_ssize_t size = 0;
+    for (Py_ssize_t level = 0; level < nargs; level++) {
+        PyObject *column = PySequence_Fast(args[level],
+                                           "expected an iterable of keys");
+        if (!column) {
+            goto error;
+        }
+        PyTuple_SET_ITEM(columns, level, column);
+        if (level && PySequence_Fast_GET_SIZE(column) != size) {
+            PyErr_SetString(PyExc_ValueError,
+                            "all columns must have the same length");
+            goto error;
+        }
+        size = PySequence_Fast_GET_SIZE(column);
+    }
+    int64_t *data;
+    PyObject *bytes = new_indexer(size, &data);
+    if (!bytes) {
+        goto error;
+    }
+    for (Py_ssize_t index = 0; index < size; index++) {
+        for (Py_ssize_t level = 0; level < nargs; level++) {
+            PyObject *column = PyTuple_GET_ITEM(columns, level);
+            rowbuffer[level] = PySequence_Fast_GET_ITEM(column, index);
+        }
+        Py_ssize_t result = fcam_lookup(self, rowbuffer);
+        if (result < 0 && PyErr_Occurred()) {
+            Py_DECREF(bytes);
+            goto error;
+        }
+        data[index] = result;
+    }
+    PyMem_Free(rowbuffer);
+    Py_DECREF(columns);
+    return finish_indexer(bytes);
+error:
+    PyMem_Free(rowbuffer);
+    Py_DECREF(columns);
+    return NULL;
+}
+
+
+static PyObject *
+fcam_columns(FCAMObject *self, void *closure)
+{
+    PyObject *columns = PyTuple_New(self->depth);
+    if (!columns) {
+        return NULL;
+    }
+    for (Py_ssize_t level = 0; level < self->depth; level++) {
+        PyObject *column = PyList_AsTuple(PyTuple_GET_ITEM(self->columns,
+                                                           level));
+        if (!column) {
+            Py_DECREF(columns);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(columns, level, column);
+    }
+    return columns;
+}
+
+
+static PyGetSetDef fcam_getset[] = {
+    {"columns", (getter) fcam_columns, NULL, NULL, NULL},
+    {NULL},
+};
+
+
+static PyMethodDef fcam_methods[] = {
+    {"__getnewargs__", (PyCFunction) fcam___getnewargs__, METH_NOARGS, NULL},
+    {"__reversed__", (PyCFunction) fcam___reversed__, METH_NOARGS, NULL},
+    {"__sizeof__", (PyCFunction) fcam___sizeof__, METH_NOARGS, NULL},
+    {"get", (PyCFunction) fcam_get, METH_FASTCALL, NULL},
+    {"get_indexer", (PyCFunction) fcam_get_indexer, METH_FASTCALL, NULL},
+    {"get_loc", (PyCFunction) fcam_get_loc, METH_FASTCALL, NULL},
+    {"items", (PyCFunction) fcam_items, METH_NOARGS, NULL},
+    {"keys", (PyCFunction) fcam_keys, METH_NOARGS, NULL},
+    {"values", (PyCFunction) fcam_values, METH_NOARGS, NULL},
     {NULL},
 };
 
 
+typedef struct {
+    FCAMObject *self;
+    PyObject **row;
+} rowreader;
+
+
+static PyObject *const *
+fcam_row_at(const rowreader *reader, Py_ssize_t i)
+{
+    // Gather row i into the reader's buffer:
+    for (Py_ssize_t level = 0; level < reader->self->depth; level++) {
+        PyObject *column = PyTuple_GET_ITEM(reader->self->columns, level);
+        reader->row[level] = PyList_GET_ITEM(column, i);
+    }
+    return reader->row;
+}
+
+
+static Py_hash_t
+hash_row_at(const void *context, Py_ssize_t i)
+{
+    const rowreader *reader = context;
+    return hash_row(fcam_row_at(reader, i), reader->self->depth);
+}
+
+
+static int
+fcam_insert_all(FCAMObject *self)
+{
+    // The same batched pipeline as insert_many():
+    Py_hash_t hashes[BATCH];
+    rowreader reader = {self, PyMem_New(PyObject *, self->depth)};
+    if (!reader.row) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (Py_ssize_t start = 0; start < self->keys_size; start += BATCH) {
+        Py_ssize_t stop = Py_MIN(self->keys_size, start + BATCH);
+        if (hash_batch(self->table, self->tablesize, start, stop, hash_row_at,
+                       &reader, hashes) < stop)
+        {
+            PyMem_Free(reader.row);
+            return -1;
+        }
+        for (Py_ssize_t i = start; i < stop; i++) {
+            PyObject *const *row = fcam_row_at(&reader, i);
+            Py_ssize_t index = fcam_lookup_hash(self, row, hashes[i - start]);
+            if (index < 0) {
+                PyMem_Free(reader.row);
+                return -1;
+            }
+            if (self->table[index].hash != -1) {
+                PyObject *key = row_tuple(row, self->depth);
+                if (key) {
+                    set_key_error(NonUniqueError, key);
+                    Py_DECREF(key);
+                }
+                PyMem_Free(reader.row);
+                return -1;
+            }
+            self->table[index].index = i;
+            self->table[index].hash = hashes[i - start];
+        }
+    }
+    PyMem_Free(reader.row);
+    return 0;
+}
+
+
 static PyObject *
-fam_new(PyTypeObject *cls, PyObject *args, PyObject *kwargs)
+fcam_new(PyTypeObject *cls, PyObject *args, PyObject *kwargs)
 {
     const char *name = cls->tp_name;
-    if (kwargs) {
+    if (kwargs && PyDict_GET_SIZE(kwargs)) {
         PyErr_Format(PyExc_TypeError, "%s takes no keyword arguments", name);
         return NULL;
     }
-    PyObject *keys = NULL;
-    if (!PyArg_UnpackTuple(args, name, 0, 1, &keys)) {
+    Py_ssize_t depth = PyTuple_GET_SIZE(args);
+    if (!depth) {
+        PyErr_Format(PyExc_TypeError, "%s expected at least 1 column", name);
         return NULL;
     }
-    if (!keys) {
-        keys = PyList_New(0);
-    }
-    else if (PyObject_TypeCheck(keys, &FAMType)) {
-        return (PyObject *)copy(cls, (FAMObject *)keys);
+    PyObject *columns = PyTuple_New(depth);
+    if (!columns) {
+        return NULL;
     }
-    else {
-        keys = PySequence_List(keys);
+    Py_ssize_t size = 0;
+    for (Py_ssize_t level = 0; level < depth; level++) {
+        PyObject *column = PySequence_List(PyTuple_GET_ITEM(args, level));
+        if (!column) {
+            Py_DECREF(columns);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(columns, level, column);
+        if (level && PyList_GET_SIZE(column) != size) {
+            PyErr_SetString(PyExc_ValueError,
+                            "all columns must have the same length");
+            Py_DECREF(columns);
+            return NULL;
+        }
+        size = PyList_GET_SIZE(column);
     }
-    if (!keys) {
+    if (fill_intcache(size)) {
+        Py_DECREF(columns);
         return NULL;
     }
-    FAMObject *self = (FAMObject *)cls->tp_alloc(cls, 0);
+    FCAMObject *self = (FCAMObject *)cls->tp_alloc(cls, 0);
     if (!self) {
-        Py_DECREF(keys);
+        Py_DECREF(columns);
         return NULL;
     }
-    self->keys = keys;
-    count += PyList_GET_SIZE(keys);
-    if (grow(self, PyList_GET_SIZE(keys))) {
+    self->columns = columns;
+    self->depth = depth;
+    self->keys_size = size;
+    count += size;
+    self->tablesize = table_size(size);
+    self->table = table_empty(self->tablesize);
+    if (!self->table || fcam_insert_all(self)) {
         Py_DECREF(self);
         return NULL;
     }
-    for (Py_ssize_t index = 0; index < PyList_GET_SIZE(keys); index++) {
-        if (insert(self, PyList_GET_ITEM(self->keys, index), index, -1)) {
-            Py_DECREF(self);
-            return NULL;
-        }
-    }
     return (PyObject *)self;
 }
 
 
 static PyObject *
-fam_repr(FAMObject *self)
+fcam_repr(FCAMObject *self)
 {
-    return PyUnicode_FromFormat("%s(%R)", Py_TYPE(self)->tp_name, self->keys);
+    PyObject *reprs = PyList_New(self->depth);
+    if (!reprs) {
+        return NULL;
+    }
+    for (Py_ssize_t level = 0; level < self->depth; level++) {
+        PyObject *repr = PyObject_Repr(PyTuple_GET_ITEM(self->columns, level));
+        if (!repr) {
+            Py_DECREF(reprs);
+            return NULL;
+        }
+        PyList_SET_ITEM(reprs, level, repr);
+    }
+    PyObject *separator = PyUnicode_FromString(", ");
+    if (!separator) {
+        Py_DECREF(reprs);
+        return NULL;
+    }
+    PyObject *joined = PyUnicode_Join(separator, reprs);
+    Py_DECREF(separator);
+    Py_DECREF(reprs);
+    if (!joined) {
+        return NULL;
+    }
+    PyObject *repr = PyUnicode_FromFormat("%s(%U)", Py_TYPE(self)->tp_name,
+                                          joined);
+    Py_DECREF(joined);
+    return repr;
 }
 
 
 static PyObject *
-fam_richcompare(FAMObject *self, PyObject *other, int op)
+fcam_richcompare(FCAMObject *self, PyObject *other, int op)
 {
-    if (!PyObject_TypeCheck(other, &FAMType)) {
+    if (!PyObject_TypeCheck(other, &FCAMType)) {
         Py_RETURN_NOTIMPLEMENTED;
     }
-    return PyObject_RichCompare(self->keys, ((FAMObject *)other)->keys, op);
+    return PyObject_RichCompare(self->columns, ((FCAMObject *)other)->columns,
+                                op);
 }
 
 
-static PyTypeObject FAMType = {
+static PyTypeObject FCAMType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_as_mapping = &fam_as_mapping,
-    .tp_as_number = &fam_as_number,
-    .tp_as_sequence = &fam_as_sequence,
-    .tp_basicsize = sizeof(FAMObject),
-    .tp_dealloc = (destructor) fam_dealloc,
-    .tp_doc = "An immutable autoincremented integer-valued mapping.",
-    .tp_hash = (hashfunc) fam_hash,
-    .tp_iter = (getiterfunc) fam_iter,
-    .tp_methods = fam_methods,
-    .tp_name = "automap.FrozenAutoMap",
-    .tp_new = fam_new,
-    .tp_repr = (reprfunc) fam_repr,
-    .tp_richcompare = (richcmpfunc) fam_richcompare,
+    .tp_as_mapping = &fcam_as_mapping,
+    .tp_as_sequence = &fcam_as_sequence,
+    .tp_basicsize = sizeof(FCAMObject),
+    .tp_dealloc = (destructor) fcam_dealloc,
+    .tp_doc = "An immutable autoincremented integer-valued mapping with "
+              "multi-column keys.",
+    .tp_getset = fcam_getset,
+    .tp_hash = (hashfunc) fcam_hash,
+    .tp_iter = (getiterfunc) fcam_iter,
+    .tp_methods = fcam_methods,
+    .tp_name = "automap.FrozenCompositeAutoMap",
+    .tp_new = fcam_new,
+    .tp_repr = (reprfunc) fcam_repr,
+    .tp_richcompare = (richcmpfunc) fcam_richcompare,
 };
 
 
 static PyObject *
-am_inplace_or(FAMObject *self, PyObject *other)
+set_allocator(PyObject *module, PyObject *capsule)
 {
-    if (PyObject_TypeCheck(other, &FAMType)) {
-        other = ((FAMObject *)other)->keys;
+    if (capsule == Py_None) {
+        allocator.ctx = NULL;
+        allocator.malloc = NULL;
+        allocator.free = NULL;
+        Py_CLEAR(allocator_capsule);
+        Py_RETURN_NONE;
     }
-    if (extend(self, other)) {
+    AutoMapAllocator *new = PyCapsule_GetPointer(capsule, "automap.Allocator");
+    if (!new) {
         return NULL;
     }
-    Py_INCREF(self);
-    return (PyObject *)self;
+    if (!new->malloc || !new->free) {
+        PyErr_SetString(PyExc_ValueError,
+                        "allocator must define malloc and free");
+        return NULL;
+    }
+    allocator = *new;
+    Py_INCREF(capsule);
+    Py_XSETREF(allocator_capsule, capsule);
+    Py_RETURN_NONE;
 }
 
 
-static PyNumberMethods am_as_number = {
-    .nb_inplace_or = (binaryfunc) am_inplace_or,
-};
-
-
 static PyObject *
-am_add(FAMObject *self, PyObject *other)
+set_huge_page_threshold(PyObject *module, PyObject *size)
 {
-    if (append(self, other)) {
+    if (size == Py_None) {
+        huge_page_threshold = -1;
+        Py_RETURN_NONE;
+    }
+    Py_ssize_t threshold = PyLong_AsSsize_t(size);
+    if (threshold == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be non-negative");
         return NULL;
     }
+    huge_page_threshold = threshold;
     Py_RETURN_NONE;
 }
 
 
-static PyObject *
-am_update(FAMObject *self, PyObject *other)
+static PyMethodDef automap_methods[] = {
+    {"set_allocator", (PyCFunction) set_allocator, METH_O, NULL},
+    {"set_huge_page_threshold", (PyCFunction) set_huge_page_threshold, METH_O,
+     NULL},
+    {NULL},
+};
+
+
+static Py_ssize_t
+capi_lookup(PyObject *map, PyObject *key, Py_hash_t hash)
 {
-    if (PyObject_TypeCheck(other, &FAMType)) {
-        other = ((FAMObject *)other)->keys;
+    return lookup((FAMObject *)map, key, hash);
+}
+
+
+static int
+capi_lookup_many(PyObject *map, PyObject *const *keys, Py_ssize_t size,
+                 Py_ssize_t *out)
+{
+    for (Py_ssize_t i = 0; i < size; i++) {
+        out[i] = lookup((FAMObject *)map, keys[i], -1);
+        if (out[i] < 0 && PyErr_Occurred()) {
+            return -1;
+        }
     }
-    if (extend(self, other)) {
+    return 0;
+}
+
+
+static Py_ssize_t
+capi_length(PyObject *map)
+{
+    return ((FAMObject *)map)->keys_size;
+}
+
+
+static PyObject *
+capi_key_at(PyObject *map, Py_ssize_t index)
+{
+    FAMObject *self = (FAMObject *)map;
+    if (index < 0 || self->keys_size <= index) {
+        PyErr_SetString(PyExc_IndexError, "index out of range");
         return NULL;
     }
-    Py_RETURN_NONE;
+    return key_at(self, index);
 }
 
 
-static PyMethodDef am_methods[] = {
-    {"add", (PyCFunction) am_add, METH_O, NULL},
-    {"update", (PyCFunction) am_update, METH_O, NULL},
-    {NULL},
-};
+static int
+capi_append(PyObject *map, PyObject *key)
+{
+    if (!PyObject_TypeCheck(map, &AMType)) {
+        PyErr_SetString(PyExc_TypeError, "expected an AutoMap");
+        return -1;
+    }
+    return append((FAMObject *)map, key);
+}
 
 
-static PyTypeObject AMType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_as_number = &am_as_number,
-    .tp_base = &FAMType,
-    .tp_doc = "A grow-only autoincremented integer-valued mapping.",
-    .tp_methods = am_methods,
-    .tp_name = "automap.AutoMap",
-    .tp_richcompare = (richcmpfunc) fam_richcompare,
+static AutoMap_CAPI capi = {
+    .version = AUTOMAP_API_VERSION,
+    .AutoMapType = &AMType,
+    .FrozenAutoMapType = &FAMType,
+    .lookup = capi_lookup,
+    .lookup_many = capi_lookup_many,
+    .length = capi_length,
+    .key_at = capi_key_at,
+    .append = capi_append,
 };
 
 
 static struct PyModuleDef automap_module = {
     .m_base = PyModuleDef_HEAD_INIT,
     .m_doc = "High-performance autoincremented integer-valued mappings.",
+    .m_methods = automap_methods,
     .m_name = "automap",
     .m_size = -1,
 };
@@ -1021,18 +3937,31 @@ PyInit_automap(void)
     if (NonUniqueError == NULL) {
         return NULL;
     }
+    PyObject *seed = PyUnicode_FromString("automap");
+    if (!seed) {
+        return NULL;
+    }
+    string_seed = (uint64_t)PyObject_Hash(seed);
+    Py_DECREF(seed);
 
     PyObject *automap = PyModule_Create(&automap_module);
+    PyObject *api = PyCapsule_New(&capi, AUTOMAP_CAPSULE_NAME, NULL);
     if (
         !automap
+        || !api
         || PyType_Ready(&AMType)
         || PyType_Ready(&FAMIType)
         || PyType_Ready(&FAMVType)
         || PyType_Ready(&FAMType)
+        || PyType_Ready(&FCAMType)
         || PyModule_AddObject(automap, "AutoMap", (PyObject *)&AMType)
         || PyModule_AddObject(automap, "FrozenAutoMap", (PyObject *)&FAMType)
+        || PyModule_AddObject(automap, "FrozenCompositeAutoMap",
+                              (PyObject *)&FCAMType)
         || PyModule_AddObject(automap, "NonUniqueError", NonUniqueError)
+        || PyModule_AddObject(automap, "_C_API", api)
     ) {
+        Py_XDECREF(api);
         Py_XDECREF(automap);
         return NULL;
     }
@@ -0,0 +1,106 @@
+/*******************************************************************************
+
+The automap C API.
+
+Other extensions can use this to work with automap objects directly, without
+going through Python-level calls or boxing the results:
+
+    # include "automap.h"
+
+    // Once, when your module is initialized:
+    if (AutoMap_IMPORT() < 0) {
+        return NULL;
+    }
+
+    // Then, anywhere:
+    Py_ssize_t index = AutoMapAPI->lookup(map, key, -1);
+    if (index < 0 && PyErr_Occurred()) {
+        ...
+    }
+
+This header is installed next to the automap extension module itself, so the
+include directory is os.path.dirname(automap.__file__).
+
+Unless stated otherwise, map arguments must be automap objects (check them with
+the AutoMapType and FrozenAutoMapType members first if you don't know that
+already), and the GIL must be held.
+
+*******************************************************************************/
+
+# ifndef AUTOMAP_H
+# define AUTOMAP_H
+
+# include "Python.h"
+
+# define AUTOMAP_API_VERSION 1
+# define AUTOMAP_CAPSULE_NAME "automap._C_API"
+
+
+// Other extensions can provide their own table allocator (for an arena, or
+// NUMA-local memory) by passing a capsule named "automap.Allocator" holding one
+// of these to automap.set_allocator(). Tables keep the capsule alive until
+// they're freed, so its destructor can release ctx.
+
+typedef struct {
+    void *ctx;
+    void *(*malloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+} AutoMapAllocator;
+
+
+typedef struct {
+    // AUTOMAP_API_VERSION of the module providing this. New members are only
+    // ever added to the end, so anything newer than your header is fine.
+    int version;
+
+    PyTypeObject *AutoMapType;
+    PyTypeObject *FrozenAutoMapType;
+
+    // The value for key, or -1 if it's missing or an error occurred (check
+    // PyErr_Occurred() to tell which). If you already know the key's hash, pass
+    // it as hash to skip recomputing it; otherwise, pass -1.
+    Py_ssize_t (*lookup)(PyObject *map, PyObject *key, Py_hash_t hash);
+
+    // Look up size keys at once, storing their values (or -1 for missing keys)
+    // in out. Returns 0 on success, or -1 with an exception set.
+    int (*lookup_many)(PyObject *map, PyObject *const *keys, Py_ssize_t size,
+                       Py_ssize_t *out);
+
+    // The number of keys in map.
+    Py_ssize_t (*length)(PyObject *map);
+
+    // A new reference to the key with the given value, or NULL with an
+    // IndexError set if it's out of range.
+    PyObject *(*key_at)(PyObject *map, Py_ssize_t index);
+
+    // Add key to map, which must be an AutoMap. Returns 0 on success, or -1
+    // with an exception set.
+    int (*append)(PyObject *map, PyObject *key);
+} AutoMap_CAPI;
+
+
+# ifndef AUTOMAP_MODULE
+
+static AutoMap_CAPI *AutoMapAPI = NULL;
+
+
+static inline int
+AutoMap_IMPORT(void)
+{
+    AutoMapAPI = (AutoMap_CAPI *)PyCapsule_Import(AUTOMAP_CAPSULE_NAME, 0);
+    if (!AutoMapAPI) {
+        return -1;
+    }
+    if (AutoMapAPI->version < AUTOMAP_API_VERSION) {
+        PyErr_Format(PyExc_ImportError,
+                     "automap C API version %d is too old (need %d)",
+                     AutoMapAPI->version, AUTOMAP_API_VERSION);
+        AutoMapAPI = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+# endif
+
+# endif
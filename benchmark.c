@@ -0,0 +1,583 @@
+/*******************************************************************************
+
+A standalone microbenchmark for the hash table routines in automap.c.
+
+The Python-level "invoke performance" task can't separate the cost of our table
+from the cost of the interpreter around it, so this program embeds Python and
+drives lookup_hash(), insert(), insert_many(), and grow() directly on synthetic
+key sets. We include automap.c itself (rather than linking against the
+extension) so that we can get at its static functions.
+
+On Linux, each operation is also measured with hardware performance counters
+(cycles, instructions, L1 data cache read misses, last-level cache misses, and
+branch misses) via perf_event_open. Counters that can't be opened (because of
+perf_event_paranoid, a virtual machine without a PMU, or another platform), or
+that were never scheduled, are reported as null. Counts from counters that were
+multiplexed with others are scaled up to the whole run.
+
+Everything is written to stdout as JSON, with times and counters normalized per
+key. Usage:
+
+    benchmark [SIZE ...]
+
+"invoke benchmark" builds and runs it against the current interpreter.
+
+*******************************************************************************/
+
+# include "automap.c"
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <time.h>
+
+# ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+# endif
+
+
+# define REPEAT 5
+
+
+typedef enum {
+    CYCLES,
+    INSTRUCTIONS,
+    L1_MISSES,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    COUNTERS,
+} Counter;
+
+
+static const char *counter_names[COUNTERS] = {
+    "cycles",
+    "instructions",
+    "l1d_misses",
+    "llc_misses",
+    "branch_misses",
+};
+
+
+typedef struct {
+    double ns;
+    double counters[COUNTERS];
+    int valid[COUNTERS];
+} measurement;
+
+
+# ifdef __linux__
+
+static int counter_fds[COUNTERS];
+
+
+static int
+open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // If there are more counters than the PMU has room for, the kernel takes
+    // turns with them. Ask how long each was actually running, so we can scale
+    // up its count to the whole measurement:
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static void
+open_counters(void)
+{
+    counter_fds[CYCLES] = open_counter(PERF_TYPE_HARDWARE,
+                                       PERF_COUNT_HW_CPU_CYCLES);
+    counter_fds[INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE,
+                                             PERF_COUNT_HW_INSTRUCTIONS);
+    counter_fds[L1_MISSES] = open_counter(
+        PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counter_fds[LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE,
+                                           PERF_COUNT_HW_CACHE_MISSES);
+    counter_fds[BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE,
+                                              PERF_COUNT_HW_BRANCH_MISSES);
+}
+
+
+static void
+start_counters(void)
+{
+    for (int i = 0; i < COUNTERS; i++) {
+        if (0 <= counter_fds[i]) {
+            ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+
+static void
+stop_counters(measurement *m)
+{
+    for (int i = 0; i < COUNTERS; i++) {
+        // value, time_enabled, time_running:
+        uint64_t values[3];
+        m->valid[i] = 0;
+        if (counter_fds[i] < 0) {
+            continue;
+        }
+        ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        // A counter that never got scheduled has nothing to scale, so it's
+        // reported as null rather than zero:
+        if (read(counter_fds[i], values, sizeof(values)) == sizeof(values) &&
+            values[2])
+        {
+            m->counters[i] = (double)values[0] * values[1] / values[2];
+            m->valid[i] = 1;
+        }
+    }
+}
+
+
+static void
+close_counters(void)
+{
+    for (int i = 0; i < COUNTERS; i++) {
+        if (0 <= counter_fds[i]) {
+            close(counter_fds[i]);
+            counter_fds[i] = -1;
+        }
+    }
+}
+
+# else
+
+static void
+open_counters(void)
+{
+}
+
+
+static void
+start_counters(void)
+{
+}
+
+
+static void
+stop_counters(measurement *m)
+{
+    for (int i = 0; i < COUNTERS; i++) {
+        m->valid[i] = 0;
+    }
+}
+
+
+static void
+close_counters(void)
+{
+}
+
+# endif
+
+
+static double
+now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+
+static void
+start(measurement *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->ns = now();
+    start_counters();
+}
+
+
+static void
+stop(measurement *m, Py_ssize_t operations)
+{
+    stop_counters(m);
+    m->ns = (now() - m->ns) / operations;
+    for (int i = 0; i < COUNTERS; i++) {
+        m->counters[i] /= operations;
+    }
+}
+
+
+// A tiny xorshift generator, so that runs are reproducible:
+
+static uint64_t state = 88172645463325252ULL;
+
+
+static uint64_t
+random_next(void)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+
+static PyObject *
+make_keys(const char *kind, Py_ssize_t start, Py_ssize_t size)
+{
+    PyObject *keys = PyList_New(size);
+    if (!keys) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < size; i++) {
+        PyObject *key;
+        if (!strcmp(kind, "int")) {
+            key = PyLong_FromSsize_t(start + i);
+        }
+        else {
+            key = PyUnicode_FromFormat("%zd", start + i);
+        }
+        if (!key) {
+            Py_DECREF(keys);
+            return NULL;
+        }
+        PyList_SET_ITEM(keys, i, key);
+    }
+    return keys;
+}
+
+
+static Py_hash_t *
+make_hashes(PyObject *keys)
+{
+    Py_ssize_t size = PyList_GET_SIZE(keys);
+    Py_hash_t *hashes = PyMem_New(Py_hash_t, size);
+    if (!hashes) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < size; i++) {
+        hashes[i] = PyObject_Hash(PyList_GET_ITEM(keys, i));
+        if (hashes[i] == -1) {
+            PyMem_Free(hashes);
+            return NULL;
+        }
+    }
+    return hashes;
+}
+
+
+static Py_ssize_t *
+make_order(Py_ssize_t size)
+{
+    Py_ssize_t *order = PyMem_New(Py_ssize_t, size);
+    if (!order) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < size; i++) {
+        order[i] = i;
+    }
+    for (Py_ssize_t i = size - 1; 0 < i; i--) {
+        Py_ssize_t j = random_next() % (i + 1);
+        Py_ssize_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    return order;
+}
+
+
+static FAMObject *
+make_map(PyObject *keys)
+{
+    // An empty map that owns the keys, but hasn't inserted them yet:
+    FAMObject *map = (FAMObject *)FAMType.tp_alloc(&FAMType, 0);
+    if (!map) {
+        return NULL;
+    }
+    Py_INCREF(keys);
+    map->keys = keys;
+    map->keys_size = PyList_GET_SIZE(keys);
+    count += map->keys_size;
+    return map;
+}
+
+
+static int
+fill(FAMObject *map, Py_hash_t *hashes)
+{
+    if (grow(map, map->keys_size)) {
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < map->keys_size; i++) {
+        if (insert(map, PyList_GET_ITEM(map->keys, i), i, hashes[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int
+bench_insert(PyObject *keys, Py_hash_t *hashes, measurement *m)
+{
+    FAMObject *map = make_map(keys);
+    if (!map) {
+        return -1;
+    }
+    if (grow(map, map->keys_size)) {
+        Py_DECREF(map);
+        return -1;
+    }
+    start(m);
+    for (Py_ssize_t i = 0; i < map->keys_size; i++) {
+        if (insert(map, PyList_GET_ITEM(keys, i), i, hashes[i])) {
+            // Don't leave the counters running:
+            stop(m, 1);
+            Py_DECREF(map);
+            return -1;
+        }
+    }
+    stop(m, map->keys_size);
+    Py_DECREF(map);
+    return 0;
+}
+
+
+static int
+bench_insert_many(PyObject *keys, Py_hash_t *hashes, measurement *m)
+{
+    // Unlike bench_insert, this includes hashing the keys (which is part of
+    // the pipeline used by construction and extension):
+    FAMObject *map = make_map(keys);
+    if (!map) {
+        return -1;
+    }
+    if (grow(map, map->keys_size)) {
+        Py_DECREF(map);
+        return -1;
+    }
+    start(m);
+    if (insert_many(map, PySequence_Fast_ITEMS(keys), map->keys_size, 0, 0)) {
+        stop(m, 1);
+        Py_DECREF(map);
+        return -1;
+    }
+    stop(m, map->keys_size);
+    Py_DECREF(map);
+    return 0;
+}
+
+
+static int
+bench_grow(PyObject *keys, Py_hash_t *hashes, measurement *m)
+{
+    FAMObject *map = make_map(keys);
+    if (!map) {
+        return -1;
+    }
+    if (fill(map, hashes)) {
+        Py_DECREF(map);
+        return -1;
+    }
+    // Force a rehash into a table twice the size:
+    Py_ssize_t needed = (Py_ssize_t)(map->tablesize * LOAD) + 1;
+    start(m);
+    if (grow(map, needed)) {
+        stop(m, 1);
+        Py_DECREF(map);
+        return -1;
+    }
+    stop(m, map->keys_size);
+    Py_DECREF(map);
+    return 0;
+}
+
+
+static int
+bench_lookup(FAMObject *map, PyObject *keys, Py_hash_t *hashes,
+             Py_ssize_t *order, measurement *m)
+{
+    Py_ssize_t size = PyList_GET_SIZE(keys);
+    // Accumulate the results so that the loop can't be optimized away:
+    Py_ssize_t sink = 0;
+    start(m);
+    for (Py_ssize_t i = 0; i < size; i++) {
+        Py_ssize_t k = order[i];
+        Py_ssize_t index = lookup_hash(map, PyList_GET_ITEM(keys, k),
+                                       hashes[k]);
+        if (index < 0) {
+            stop(m, 1);
+            return -1;
+        }
+        sink += index;
+    }
+    stop(m, size);
+    return sink < 0;
+}
+
+
+static void
+emit(const char *operation, const char *kind, Py_ssize_t size,
+     measurement *m, int *first)
+{
+    printf("%s\n    {\"operation\": \"%s\", \"keys\": \"%s\", \"size\": %zd, "
+           "\"ns\": %.3f",
+           *first ? "" : ",", operation, kind, size, m->ns);
+    for (int i = 0; i < COUNTERS; i++) {
+        if (m->valid[i]) {
+            printf(", \"%s\": %.3f", counter_names[i], m->counters[i]);
+        }
+        else {
+            printf(", \"%s\": null", counter_names[i]);
+        }
+    }
+    printf("}");
+    *first = 0;
+}
+
+
+typedef int (*bench_function)(PyObject *, Py_hash_t *, measurement *);
+
+
+static int
+best(bench_function function, PyObject *keys, Py_hash_t *hashes,
+     measurement *result)
+{
+    for (int r = 0; r < REPEAT; r++) {
+        measurement m;
+        if (function(keys, hashes, &m)) {
+            return -1;
+        }
+        if (!r || m.ns < result->ns) {
+            *result = m;
+        }
+    }
+    return 0;
+}
+
+
+static int
+best_lookup(FAMObject *map, PyObject *keys, Py_hash_t *hashes,
+            Py_ssize_t *order, measurement *result)
+{
+    for (int r = 0; r < REPEAT; r++) {
+        measurement m;
+        if (bench_lookup(map, keys, hashes, order, &m)) {
+            return -1;
+        }
+        if (!r || m.ns < result->ns) {
+            *result = m;
+        }
+    }
+    return 0;
+}
+
+
+static int
+run(const char *kind, Py_ssize_t size, int *first)
+{
+    int status = -1;
+    PyObject *keys = make_keys(kind, 0, size);
+    PyObject *misses = make_keys(kind, size, size);
+    Py_hash_t *hashes = NULL;
+    Py_hash_t *miss_hashes = NULL;
+    Py_ssize_t *order = NULL;
+    FAMObject *map = NULL;
+    measurement m;
+    if (!keys || !misses ||
+        !(hashes = make_hashes(keys)) ||
+        !(miss_hashes = make_hashes(misses)) ||
+        !(order = make_order(size)) ||
+        !(map = make_map(keys)) ||
+        fill(map, hashes))
+    {
+        goto done;
+    }
+    if (best(bench_insert, keys, hashes, &m)) {
+        goto done;
+    }
+    emit("insert", kind, size, &m, first);
+    if (best(bench_insert_many, keys, hashes, &m)) {
+        goto done;
+    }
+    emit("insert_many", kind, size, &m, first);
+    if (best(bench_grow, keys, hashes, &m)) {
+        goto done;
+    }
+    emit("grow", kind, size, &m, first);
+    if (best_lookup(map, keys, hashes, order, &m)) {
+        goto done;
+    }
+    emit("lookup_hash/hit", kind, size, &m, first);
+    if (best_lookup(map, misses, miss_hashes, order, &m)) {
+        goto done;
+    }
+    emit("lookup_hash/miss", kind, size, &m, first);
+    status = 0;
+done:
+    Py_XDECREF(map);
+    PyMem_Free(order);
+    PyMem_Free(miss_hashes);
+    PyMem_Free(hashes);
+    Py_XDECREF(misses);
+    Py_XDECREF(keys);
+    return status;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    Py_ssize_t default_sizes[] = {1000, 100000, 1000000};
+    Py_ssize_t sizes[64];
+    int nsizes = 0;
+    for (int i = 1; i < argc && nsizes < 64; i++) {
+        sizes[nsizes] = strtoll(argv[i], NULL, 10);
+        if (sizes[nsizes] <= 0) {
+            fprintf(stderr, "usage: %s [SIZE ...]\n", argv[0]);
+            return 2;
+        }
+        nsizes++;
+    }
+    if (!nsizes) {
+        nsizes = sizeof(default_sizes) / sizeof(*default_sizes);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+    PyImport_AppendInittab("automap", PyInit_automap);
+    Py_Initialize();
+    PyObject *module = PyImport_ImportModule("automap");
+    if (!module) {
+        PyErr_Print();
+        return 1;
+    }
+    open_counters();
+    printf("{\n  \"python\": \"%s\",\n  \"results\": [", PY_VERSION);
+    int first = 1;
+    const char *kinds[] = {"int", "str"};
+    for (int k = 0; k < 2; k++) {
+        for (int s = 0; s < nsizes; s++) {
+            if (run(kinds[k], sizes[s], &first)) {
+                PyErr_Print();
+                close_counters();
+                return 1;
+            }
+            fflush(stdout);
+        }
+    }
+    close_counters();
+    printf("\n  ]\n}\n");
+    Py_DECREF(module);
+    return Py_FinalizeEx() < 0;
+}
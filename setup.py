@@ -1,13 +1,26 @@
+import shutil
+
 import setuptools
+import setuptools.command.build_ext
 
 with open("README.md") as file:
     LONG_DESCRIPTION = file.read()
 
+
+class build_ext(setuptools.command.build_ext.build_ext):
+    # Install our C API header right next to the extension module:
+    def run(self):
+        super().run()
+        if not self.inplace:
+            shutil.copy("automap.h", self.build_lib)
+
+
 setuptools.setup(
     author="Brandt Bucher",
     author_email="brandt@python.org",
+    cmdclass={"build_ext": build_ext},
     description="High-performance autoincremented integer-valued mappings.",
-    ext_modules=[setuptools.Extension("automap", ["automap.c"])],
+    ext_modules=[setuptools.Extension("automap", ["automap.c"], depends=["automap.h"])],
     license="MIT",
     long_description=LONG_DESCRIPTION,
     long_description_content_type="text/markdown",
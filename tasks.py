@@ -4,6 +4,7 @@ import multiprocessing
 import operator
 import random
 import sys
+import sysconfig
 import timeit
 
 import invoke
@@ -40,6 +41,26 @@ def test(context):
     run(context, f"{sys.executable} -m pytest -v")
 
 
+@invoke.task
+def compile_benchmark(context):
+    # type: (invoke.Context) -> None
+    config = sysconfig.get_config_vars()
+    libdir = config["LIBDIR"]
+    run(context, "mkdir -p build")
+    run(
+        context,
+        f"{config['CC']} {config['CFLAGS']} -I{sysconfig.get_paths()['include']} "
+        f"benchmark.c -o build/benchmark -L{libdir} -Wl,-rpath,{libdir} "
+        f"-lpython{config['LDVERSION']} {config['LIBS']} {config['SYSLIBS']}",
+    )
+
+
+@invoke.task(build, compile_benchmark)
+def benchmark(context):
+    # type: (invoke.Context) -> None
+    run(context, "build/benchmark")
+
+
 def do_work(info):
     import automap
 
@@ -95,3 +116,35 @@ def performance(context):
                 f"{kind.__name__}\tMEAN\t{geometric_mean(total_create)-1:+.0%}\t{geometric_mean(total_access)-1:+.0%}\t{geometric_mean(total_size)-1:+.0%}",
                 flush=True,
             )
+
+
+CALLS = (
+    ("new", "FrozenAutoMap(keys)", "{k: i for i, k in enumerate(keys)}"),
+    ("get", "a.get(key)", "d.get(key)"),
+    ("get/default", "a.get(key, -1)", "d.get(key, -1)"),
+    ("contains", "key in a", "key in d"),
+    ("items", "for _ in a.items(): pass", "for _ in d.items(): pass"),
+)
+
+
+@invoke.task(test)
+def overhead(context):
+    # type: (invoke.Context) -> None
+    import automap
+
+    print("CALL\tNS\tDICT")
+    keys = [str(_) for _ in range(8)]
+    namespace = {
+        "FrozenAutoMap": automap.FrozenAutoMap,
+        "a": automap.FrozenAutoMap(keys),
+        "d": {k: i for i, k in enumerate(keys)},
+        "key": keys[0],
+        "keys": keys,
+    }
+    for name, a, d in CALLS:
+        timer_a = timeit.Timer(a, globals=namespace)
+        timer_d = timeit.Timer(d, globals=namespace)
+        iterations = max(timer_a.autorange()[0], timer_d.autorange()[0])
+        time_a = min(timer_a.repeat(5, iterations)) / iterations
+        time_d = min(timer_d.repeat(5, iterations)) / iterations
+        print(f"{name}\t{time_a * 1e9:.1f}\t{time_a / time_d - 1:+.0%}", flush=True)
@@ -1,3 +1,6 @@
+import ctypes
+import decimal
+import fractions
 import pickle
 import typing
 
@@ -68,6 +71,14 @@ def test_pickle(keys: Keys) -> None:
         hypothesis.assume(False)
     a = automap.AutoMap(keys)
     assert pickle.loads(pickle.dumps(a)) == a
+    for m in (
+        automap.AutoMap(keys, bloom=True),
+        automap.FrozenAutoMap(keys, bloom=True),
+    ):
+        p = pickle.loads(pickle.dumps(m))
+        assert type(p) is type(m)
+        assert p == m
+        assert p.__sizeof__() == m.__sizeof__()
 
 
 @hypothesis.given(keys=hypothesis.infer)
@@ -90,3 +101,732 @@ def test_non_unique_exception(keys: Keys):
 
     with pytest.raises(automap.NonUniqueError):
         automap.AutoMap([*keys, duplicate])
+
+
+@hypothesis.given(keys=hypothesis.infer, others=hypothesis.infer)
+def test_get_indexer(keys: Keys, others: Keys) -> None:
+    a = automap.FrozenAutoMap(keys)
+    b = automap.FrozenAutoMap(others)
+    expected = [a.get(key, -1) for key in others]
+    assert [*a.get_indexer(b)] == expected
+    assert [*a.get_indexer([*others])] == expected
+    assert [*a.get_indexer(a)] == [*range(len(keys))]
+
+
+def test_get_indexer_mutated_during_comparison() -> None:
+    class Key:
+        def __init__(self, other: typing.Optional[automap.AutoMap]) -> None:
+            self.other = other
+
+        def __hash__(self) -> int:
+            return 1
+
+        def __eq__(self, other: object) -> bool:
+            if self.other is not None:
+                target, self.other = self.other, None
+                target.update(range(1000, 200000))
+            return self is other
+
+    other = automap.AutoMap([Key(None), Key(None)])
+    a = automap.FrozenAutoMap([Key(other)])
+    assert [*a.get_indexer(other)] == [-1, -1]
+    assert len(other) == 2 + 199000
+
+
+def test_lookup_mutated_during_comparison() -> None:
+    class Key:
+        def __init__(self) -> None:
+            self.mutate: typing.Optional[typing.Callable[[], object]] = None
+
+        def __hash__(self) -> int:
+            return 1
+
+        def __eq__(self, other: object) -> bool:
+            if self.mutate is not None:
+                mutate, self.mutate = self.mutate, None
+                mutate()
+            return self is other
+
+    for mutation in ["update", "freeze", "shrink_to_fit"]:
+        key = Key()
+        a = automap.AutoMap([key])
+        key.mutate = lambda: getattr(a, mutation)(
+            *[range(1000, 200000)] if mutation == "update" else []
+        )
+        assert a.get(Key()) is None
+        key.mutate = lambda: a.update(range(200000, 400000))
+        assert [*a.get_indexer([Key()])] == [-1]
+    key = Key()
+    f = automap.FrozenAutoMap([key, *range(1000)])
+    key.mutate = f.optimize
+    assert f.get(Key()) is None
+    assert f[key] == 0
+
+
+@hypothesis.given(keys=hypothesis.infer)
+def test_auto_map_freeze(keys: Keys) -> None:
+    a = automap.AutoMap(keys)
+    f = a.freeze()
+    assert type(f) is automap.FrozenAutoMap
+    assert f == automap.FrozenAutoMap(keys)
+    for index, key in enumerate(keys):
+        assert f[key] == index
+    assert len(a) == 0
+    a.update(keys)
+    assert a == f
+
+
+@hypothesis.given(keys=hypothesis.infer, others=hypothesis.infer)
+def test_auto_map_snapshot(keys: Keys, others: Keys) -> None:
+    others -= keys
+    a = automap.AutoMap(keys)
+    s = a.snapshot()
+    a.update(others)
+    assert type(s) is automap.FrozenAutoMap
+    assert s == automap.FrozenAutoMap(keys)
+    assert hash(s) == hash(automap.FrozenAutoMap(keys))
+    assert len(s) == len(keys)
+    for index, key in enumerate(keys):
+        assert s[key] == index
+    for key in others:
+        assert key not in s
+    assert [*s.get_indexer(a)] == [*range(len(keys))] + [-1] * len(others)
+    assert [*automap.AutoMap(s)] == [*keys]
+    assert [*(s | automap.FrozenAutoMap(others))] == [*a]
+    assert s == automap.FrozenAutoMap(keys)
+
+
+@hypothesis.given(keys=hypothesis.infer, others=hypothesis.infer)
+def test_lazy(keys: Keys, others: Keys) -> None:
+    others -= keys
+    eager = automap.FrozenAutoMap(keys)
+    lazy = automap.FrozenAutoMap(keys, lazy=True)
+    assert [*lazy] == [*keys]
+    assert lazy.__sizeof__() <= eager.__sizeof__()
+    assert [*lazy.get_indexer(automap.FrozenAutoMap(others, lazy=True))] == [-1] * len(
+        others
+    )
+    for index, key in enumerate(keys):
+        assert lazy[key] == index
+    assert lazy.__sizeof__() == eager.__sizeof__()
+    assert hash(lazy) == hash(eager)
+    a = automap.AutoMap(keys, lazy=True)
+    a |= others
+    assert a == automap.AutoMap([*keys, *others])
+    with pytest.raises(TypeError):
+        automap.FrozenAutoMap(keys, eager=True)
+
+
+@hypothesis.given(keys=hypothesis.infer)
+def test_lazy_non_unique(keys: Keys) -> None:
+    hypothesis.assume(keys)
+    key = next(iter(keys))
+    lazy = automap.FrozenAutoMap([*keys, key], lazy=True)
+    assert len(lazy) == len(keys) + 1
+    for _ in range(2):
+        with pytest.raises(automap.NonUniqueError):
+            key in lazy
+
+
+@hypothesis.given(keys=hypothesis.infer, others=hypothesis.infer)
+def test_optimize(keys: Keys, others: Keys) -> None:
+    others -= keys
+    f = automap.FrozenAutoMap(keys)
+    o = automap.FrozenAutoMap(keys)
+    separable = len({hash(key) for key in keys}) == len(keys)
+    assert o.optimize() is separable
+    assert o.optimize() is separable
+    assert o == f
+    assert hash(o) == hash(f)
+    for index, key in enumerate(keys):
+        assert o[key] == index
+    for key in others:
+        assert key not in o
+    queries = automap.FrozenAutoMap([*keys, *others])
+    expected = [*range(len(keys))] + [-1] * len(others)
+    assert [*o.get_indexer(queries)] == expected
+    assert [*queries.get_indexer(o)] == [*range(len(keys))]
+    assert [*(o | automap.FrozenAutoMap(others))] == [*queries]
+    with pytest.raises(TypeError):
+        automap.AutoMap(keys).optimize()
+
+
+@hypothesis.given(keys=hypothesis.infer, others=hypothesis.infer)
+def test_right_sized(keys: Keys, others: Keys) -> None:
+    others -= keys
+    expected = automap.FrozenAutoMap([*keys, *others]).__sizeof__()
+    assert (
+        automap.FrozenAutoMap(keys) | automap.FrozenAutoMap(others)
+    ).__sizeof__() == expected
+    a = automap.AutoMap(keys)
+    s = a.snapshot()
+    a |= others
+    assert automap.FrozenAutoMap(a).__sizeof__() == expected
+    assert (s | automap.FrozenAutoMap()).__sizeof__() == automap.FrozenAutoMap(
+        keys
+    ).__sizeof__()
+    hypothesis.assume(keys)
+    with pytest.raises(automap.NonUniqueError):
+        a.update([*range(-1000, 0), *keys])
+    a.shrink_to_fit()
+    assert a == automap.AutoMap([*keys, *others, *range(-1000, 0)][: len(a)])
+    assert (
+        a.__sizeof__()
+        == automap.FrozenAutoMap(a).__sizeof__()
+        - automap.FrozenAutoMap.__basicsize__
+        + automap.AutoMap.__basicsize__
+    )
+    for index, key in enumerate(a):
+        assert a[key] == index
+    assert [*s] == [*keys]
+
+
+def test_freeze_after_failed_update() -> None:
+    a = automap.AutoMap(range(10))
+    with pytest.raises(automap.NonUniqueError):
+        a.update([5, *range(100, 100000)])
+    f = a.freeze()
+    assert f == automap.FrozenAutoMap(range(10))
+    assert f.__sizeof__() == automap.FrozenAutoMap(range(10)).__sizeof__()
+
+
+@hypothesis.given(keys=hypothesis.infer, others=hypothesis.infer)
+def test_bloom(keys: Keys, others: Keys) -> None:
+    others -= keys
+    f = automap.FrozenAutoMap(keys, bloom=True)
+    a = automap.AutoMap(bloom=True)
+    s = a.snapshot()
+    for key in keys:
+        a.add(key)
+    a |= others
+    assert f == automap.FrozenAutoMap(keys)
+    assert f.__sizeof__() > automap.FrozenAutoMap(keys).__sizeof__()
+    for index, key in enumerate(keys):
+        assert f[key] == a[key] == index
+    for key in others:
+        assert key not in f
+        assert f.get(key) is None
+    expected = [*range(len(keys))] + [-1] * len(others)
+    assert [*f.get_indexer([*keys, *others])] == expected
+    assert [*f.get_indexer(automap.FrozenAutoMap([*keys, *others]))] == expected
+    assert [*f.get_indexer(a)] == expected
+    for m in (
+        automap.FrozenAutoMap(a),
+        a.freeze(),
+        f | automap.FrozenAutoMap(others),
+        automap.FrozenAutoMap(keys, bloom=True, lazy=True)
+        | automap.FrozenAutoMap(others),
+    ):
+        assert [*m.get_indexer([*keys, *others])] == [*range(len(keys) + len(others))]
+    assert not s
+    assert not a
+    with pytest.raises(ValueError):
+        automap.FrozenAutoMap(sorted=True, bloom=True)
+
+
+Int64s = hypothesis.strategies.sets(
+    hypothesis.strategies.integers(-(2**63), 2**63 - 1)
+)
+
+
+@hypothesis.given(keys=Int64s, others=Int64s, lo=hypothesis.infer, hi=hypothesis.infer)
+def test_sorted(
+    keys: typing.Set[int],
+    others: typing.Set[int],
+    lo: typing.Optional[int],
+    hi: typing.Optional[int],
+) -> None:
+    others -= keys
+    ordered = sorted(keys)
+    s = automap.FrozenAutoMap(ordered, sorted=True)
+    f = automap.FrozenAutoMap(ordered)
+    assert len(s) == len(keys)
+    assert [*s] == ordered
+    assert s == f
+    assert hash(s) == hash(f)
+    for index, key in enumerate(ordered):
+        assert s[key] == s.get(float(key) if abs(key) < 2**53 else key) == index
+    for key in [*others, 2**64, -(2**64), 0.5, float("nan"), "0", None]:
+        assert key not in s
+    for key in ordered:
+        assert (
+            s.get(decimal.Decimal(key))
+            == s.get(fractions.Fraction(key))
+            == f.get(decimal.Decimal(key))
+        )
+        assert s.get(complex(key, 0)) == f.get(complex(key, 0))
+    for key in [decimal.Decimal("0.5"), fractions.Fraction(1, 2), (), frozenset()]:
+        assert key not in s
+    with pytest.raises(TypeError):
+        [] in s
+    assert [*s.get_indexer([complex(key, 0) for key in ordered])] == [
+        f.get(complex(key, 0), -1) for key in ordered
+    ]
+    assert [*s.get_indexer([fractions.Fraction(key) for key in ordered])] == [
+        *range(len(keys))
+    ]
+    with pytest.raises(TypeError):
+        s.get_indexer([[]])
+    queries = [*ordered, *others]
+    expected = [f.get(key, -1) for key in queries]
+    assert [*s.get_indexer(queries)] == expected
+    assert [*s.get_indexer(sorted(queries))] == [
+        f.get(key, -1) for key in sorted(queries)
+    ]
+    assert [*s.get_indexer(automap.FrozenAutoMap(sorted(queries), sorted=True))] == [
+        f.get(key, -1) for key in sorted(queries)
+    ]
+    assert [*f.get_indexer(s)] == [*range(len(keys))]
+    start, stop = s.slice_locs(lo, hi)
+    assert ordered[start:stop] == [
+        key
+        for key in ordered
+        if (lo is None or lo <= key) and (hi is None or key <= hi)
+    ]
+    assert [*(s | automap.FrozenAutoMap(others))] == queries
+    assert [*automap.AutoMap(s)] == ordered
+    p = pickle.loads(pickle.dumps(s))
+    assert p == s
+    assert p.slice_locs(lo, hi) == (start, stop)
+    with pytest.raises(TypeError):
+        f.slice_locs(lo, hi)
+    with pytest.raises(TypeError):
+        automap.AutoMap(ordered, sorted=True)
+    hypothesis.assume(keys)
+    with pytest.raises(automap.NonUniqueError):
+        automap.FrozenAutoMap([*ordered, ordered[-1]], sorted=True)
+    hypothesis.assume(1 < len(keys))
+    with pytest.raises(ValueError):
+        automap.FrozenAutoMap(ordered[::-1], sorted=True)
+
+
+def test_sorted_mixed_types() -> None:
+    keys = [
+        -(2**63),
+        -(2**61) - 1,
+        -2,
+        -1,
+        0,
+        1,
+        5,
+        2**61 - 1,
+        2**61,
+        2**63 - 1,
+    ]
+    s = automap.FrozenAutoMap(keys, sorted=True)
+    f = automap.FrozenAutoMap(keys)
+    for key in keys:
+        for query in [complex(key, 0), decimal.Decimal(key), fractions.Fraction(key)]:
+            assert s.get(query) == f.get(query)
+    assert complex(5, 0) in automap.FrozenAutoMap([5], sorted=True)
+    assert complex(5, 1) not in s
+    assert complex(-1, 0) in s and s[complex(-2, 0)] == 2
+
+
+class PyBuffer(ctypes.Structure):
+    _fields_ = [
+        ("buf", ctypes.c_void_p),
+        ("obj", ctypes.c_void_p),
+        ("len", ctypes.c_ssize_t),
+        ("itemsize", ctypes.c_ssize_t),
+        ("readonly", ctypes.c_int),
+        ("ndim", ctypes.c_int),
+        ("format", ctypes.c_char_p),
+        ("shape", ctypes.POINTER(ctypes.c_ssize_t)),
+        ("strides", ctypes.POINTER(ctypes.c_ssize_t)),
+        ("suboffsets", ctypes.POINTER(ctypes.c_ssize_t)),
+        ("internal", ctypes.c_void_p),
+    ]
+
+
+get_buffer = ctypes.pythonapi.PyObject_GetBuffer
+get_buffer.argtypes = (ctypes.py_object, ctypes.POINTER(PyBuffer), ctypes.c_int)
+release_buffer = ctypes.pythonapi.PyBuffer_Release
+release_buffer.argtypes = (ctypes.POINTER(PyBuffer),)
+
+
+@hypothesis.given(keys=hypothesis.infer)
+def test_values_buffer(keys: Keys) -> None:
+    a = automap.AutoMap(keys)
+    values = memoryview(a.values())
+    assert values.format == "q"
+    assert values.readonly
+    assert values.tolist() == [*range(len(keys))]
+    assert values.shape == (len(keys),)
+    assert values.strides == (8,)
+    # The strides must outlive the Py_buffer they were exported into:
+    view = PyBuffer()
+    assert not get_buffer(
+        a.values(), ctypes.byref(view), 0x1C
+    )  # PyBUF_STRIDES | PyBUF_FORMAT
+    try:
+        assert view.strides[0] == 8
+        assert (
+            ctypes.cast(view.strides, ctypes.c_void_p).value
+            != ctypes.addressof(view) + PyBuffer.itemsize.offset
+        )
+    finally:
+        release_buffer(ctypes.byref(view))
+    with pytest.raises(BufferError):
+        memoryview(a.keys())
+
+
+@hypothesis.given(keys=hypothesis.infer)
+def test_values___contains__(keys: Keys) -> None:
+    values = automap.FrozenAutoMap(keys).values()
+    for value in range(len(keys)):
+        assert value in values
+        assert float(value) in values
+    assert -1 not in values
+    assert len(keys) not in values
+    assert 1 << 100 not in values
+    assert None not in values
+
+
+@hypothesis.given(keys=hypothesis.infer)
+def test_auto_map_update_partial_failure(keys: Keys) -> None:
+    a = automap.AutoMap()
+    with pytest.raises(TypeError):
+        a.update([*keys, [], None])
+    assert a == automap.AutoMap(keys)
+    hypothesis.assume(keys)
+    with pytest.raises(automap.NonUniqueError):
+        a.update([next(iter(keys)), []])
+    assert a == automap.AutoMap(keys)
+
+
+@hypothesis.given(keys=hypothesis.infer, others=hypothesis.infer)
+def test_huge_page_threshold(keys: Keys, others: Keys) -> None:
+    others -= keys
+    automap.set_huge_page_threshold(0)
+    try:
+        a = automap.AutoMap(keys)
+        a.update(others)
+    finally:
+        automap.set_huge_page_threshold(1 << 21)
+    assert [*a] == [*keys, *others]
+    for index, key in enumerate(a):
+        assert a[key] == index
+
+
+Malloc = ctypes.CFUNCTYPE(ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t)
+Free = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t)
+
+
+class Allocator(ctypes.Structure):
+    _fields_ = [("ctx", ctypes.c_void_p), ("malloc", Malloc), ("free", Free)]
+
+
+def test_allocator() -> None:
+    raw_malloc = ctypes.pythonapi.PyMem_RawMalloc
+    raw_malloc.restype = ctypes.c_void_p
+    raw_malloc.argtypes = (ctypes.c_size_t,)
+    raw_free = ctypes.pythonapi.PyMem_RawFree
+    raw_free.argtypes = (ctypes.c_void_p,)
+    calls = {"malloc": 0, "free": 0, "destroyed": 0}
+
+    def malloc(ctx: int, size: int) -> int:
+        calls["malloc"] += 1
+        return raw_malloc(size)
+
+    def free(ctx: int, ptr: int, size: int) -> None:
+        calls["free"] += 1
+        raw_free(ptr)
+
+    allocator = Allocator(None, Malloc(malloc), Free(free))
+
+    @CapsuleDestructor
+    def destroy(capsule: int) -> None:
+        calls["destroyed"] += 1
+
+    capsule = capsule_new(ctypes.addressof(allocator), b"automap.Allocator", destroy)
+    automap.set_allocator(capsule)
+    try:
+        del capsule
+        a = automap.AutoMap(range(1000))
+        f = automap.FrozenAutoMap(range(100), bloom=True)
+    finally:
+        automap.set_allocator(None)
+    assert calls["malloc"] > calls["free"]
+    assert not calls["destroyed"]
+    a.update(range(1000, 10000))
+    assert [*a] == [*range(10000)]
+    assert [*f] == [*range(100)]
+    del a, f
+    assert calls["malloc"] == calls["free"]
+    assert calls["destroyed"] == 1
+
+
+class CAPI(ctypes.Structure):
+    _fields_ = [
+        ("version", ctypes.c_int),
+        ("AutoMapType", ctypes.c_void_p),
+        ("FrozenAutoMapType", ctypes.c_void_p),
+        (
+            "lookup",
+            ctypes.PYFUNCTYPE(
+                ctypes.c_ssize_t, ctypes.py_object, ctypes.py_object, ctypes.c_ssize_t
+            ),
+        ),
+        (
+            "lookup_many",
+            ctypes.PYFUNCTYPE(
+                ctypes.c_int,
+                ctypes.py_object,
+                ctypes.POINTER(ctypes.py_object),
+                ctypes.c_ssize_t,
+                ctypes.POINTER(ctypes.c_ssize_t),
+            ),
+        ),
+        ("length", ctypes.PYFUNCTYPE(ctypes.c_ssize_t, ctypes.py_object)),
+        (
+            "key_at",
+            ctypes.PYFUNCTYPE(ctypes.py_object, ctypes.py_object, ctypes.c_ssize_t),
+        ),
+        ("append", ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.py_object, ctypes.py_object)),
+    ]
+
+
+@hypothesis.given(keys=hypothesis.infer, others=hypothesis.infer)
+def test_c_api_capsule(keys: Keys, others: Keys) -> None:
+    others -= keys
+    is_valid = ctypes.pythonapi.PyCapsule_IsValid
+    is_valid.argtypes = (ctypes.py_object, ctypes.c_char_p)
+    assert is_valid(automap._C_API, b"automap._C_API")
+    api = CAPI.from_address(capsule_get_pointer(id(automap._C_API), b"automap._C_API"))
+    assert api.version == 1
+    assert api.AutoMapType == id(automap.AutoMap)
+    assert api.FrozenAutoMapType == id(automap.FrozenAutoMap)
+    a = automap.AutoMap(keys)
+    maps = [
+        (a, [*keys], [*others]),
+        (automap.FrozenAutoMap(keys, lazy=True), [*keys], [*others]),
+        (automap.FrozenAutoMap([-3, 0, 7], sorted=True), [-3, 0, 7.0], [1, 8.5, "7"]),
+        (
+            automap.FrozenAutoMap.from_arrow(ArrowStrings(["a", "bc"])),
+            ["a", "bc"],
+            ["b", b"a", None],
+        ),
+    ]
+    for m, hits, misses in maps:
+        assert api.length(m) == len(m)
+        for index, key in enumerate(hits):
+            assert api.lookup(m, key, -1) == api.lookup(m, key, hash(key)) == index
+        assert [api.key_at(m, index) for index in range(len(m))] == [*m]
+        for key in misses:
+            assert api.lookup(m, key, -1) == -1
+        queries = [*hits, *misses]
+        out = (ctypes.c_ssize_t * len(queries))()
+        assert (
+            api.lookup_many(
+                m, (ctypes.py_object * len(queries))(*queries), len(queries), out
+            )
+            == 0
+        )
+        assert [*out] == [*range(len(hits))] + [-1] * len(misses)
+        for index in (-1, len(m)):
+            with pytest.raises(IndexError):
+                api.key_at(m, index)
+        if m is not a:
+            with pytest.raises(TypeError):
+                api.append(m, object())
+    with pytest.raises(TypeError):
+        api.lookup(a, [], -1)
+    for key in others:
+        assert api.append(a, key) == 0
+    assert [*a] == [*keys, *others]
+
+
+Rows = typing.Set[typing.Tuple[int, str, bool]]
+
+
+@hypothesis.given(rows=hypothesis.infer, others=hypothesis.infer)
+def test_frozen_composite_auto_map(rows: Rows, others: Rows) -> None:
+    others -= rows
+    columns = [*zip(*rows)] or [(), (), ()]
+    a = automap.FrozenCompositeAutoMap(*columns)
+    assert len(a) == len(rows)
+    assert [*a] == [*rows]
+    assert a == pickle.loads(pickle.dumps(a))
+    for index, row in enumerate(rows):
+        assert a[row] == a.get_loc(*row) == index
+        assert row in a
+    for row in others:
+        assert row not in a
+        with pytest.raises(KeyError):
+            a.get_loc(*row)
+    queries = [*rows, *others]
+    expected = [*range(len(rows))] + [-1] * len(others)
+    assert [*a.get_indexer(*([*zip(*queries)] or [(), (), ()]))] == expected
+    assert [a.get(row) for row in queries] == [*range(len(rows))] + [None] * len(others)
+    assert [a.get(row, -1) for row in queries] == expected
+    assert a.get("not a row", -1) == -1
+    assert [*reversed(a)] == [*reversed([*rows])]
+    assert [*a.keys()] == [*rows]
+    assert [*a.values()] == [*range(len(rows))]
+    assert [*a.items()] == [*zip(rows, range(len(rows)))]
+    assert all(row in a.keys() for row in rows)
+    b = automap.FrozenCompositeAutoMap(rows)
+    assert [*b] == [*b.keys()] == [*rows]
+    assert [*reversed(b)] == [*reversed([*rows])]
+    assert [*b.items()] == [*automap.FrozenAutoMap(rows).items()]
+    hypothesis.assume(rows)
+    with pytest.raises(automap.NonUniqueError):
+        automap.FrozenCompositeAutoMap(*(column * 2 for column in columns))
+
+
+class ArrowSchema(ctypes.Structure):
+    _fields_ = [
+        ("format", ctypes.c_char_p),
+        ("name", ctypes.c_char_p),
+        ("metadata", ctypes.c_char_p),
+        ("flags", ctypes.c_int64),
+        ("n_children", ctypes.c_int64),
+        ("children", ctypes.c_void_p),
+        ("dictionary", ctypes.c_void_p),
+        ("release", ctypes.c_void_p),
+        ("private_data", ctypes.c_void_p),
+    ]
+
+
+class ArrowArray(ctypes.Structure):
+    _fields_ = [
+        ("length", ctypes.c_int64),
+        ("null_count", ctypes.c_int64),
+        ("offset", ctypes.c_int64),
+        ("n_buffers", ctypes.c_int64),
+        ("n_children", ctypes.c_int64),
+        ("buffers", ctypes.POINTER(ctypes.c_void_p)),
+        ("children", ctypes.c_void_p),
+        ("dictionary", ctypes.c_void_p),
+        ("release", ctypes.c_void_p),
+        ("private_data", ctypes.c_void_p),
+    ]
+
+
+ArrowRelease = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+CapsuleDestructor = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+capsule_new = ctypes.pythonapi.PyCapsule_New
+capsule_new.restype = ctypes.py_object
+capsule_new.argtypes = (ctypes.c_void_p, ctypes.c_char_p, CapsuleDestructor)
+capsule_get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+capsule_get_pointer.restype = ctypes.c_void_p
+capsule_get_pointer.argtypes = (ctypes.c_void_p, ctypes.c_char_p)
+
+# Everything we've exported and not had released yet, by struct address:
+exported: typing.Dict[int, typing.Any] = {}
+
+
+@ArrowRelease
+def release_arrow(address: int) -> None:
+    struct = exported.pop(address)
+    struct.release = None
+
+
+@CapsuleDestructor
+def destroy_schema(capsule: int) -> None:
+    address = capsule_get_pointer(capsule, b"arrow_schema")
+    if ArrowSchema.from_address(address).release:
+        release_arrow(address)
+
+
+@CapsuleDestructor
+def destroy_array(capsule: int) -> None:
+    address = capsule_get_pointer(capsule, b"arrow_array")
+    if ArrowArray.from_address(address).release:
+        release_arrow(address)
+
+
+class ArrowStrings:
+    """Just enough of an Arrow string array to test with, sans pyarrow."""
+
+    def __init__(self, strings: typing.Sequence[str], large: bool = False) -> None:
+        encoded = [string.encode() for string in strings]
+        offsets = [0]
+        for string in encoded:
+            offsets.append(offsets[-1] + len(string))
+        self.format = b"U" if large else b"u"
+        self.offsets = (ctypes.c_int64 if large else ctypes.c_int32) * len(offsets)
+        self.offsets = self.offsets(*offsets)
+        self.data = ctypes.create_string_buffer(b"".join(encoded))
+        self.length = len(strings)
+
+    def __arrow_c_array__(
+        self, requested_schema: object = None
+    ) -> typing.Tuple[object, object]:
+        schema = ArrowSchema(
+            format=self.format, release=ctypes.cast(release_arrow, ctypes.c_void_p)
+        )
+        buffers = (ctypes.c_void_p * 3)(
+            None, ctypes.addressof(self.offsets), ctypes.addressof(self.data)
+        )
+        array = ArrowArray(
+            length=self.length,
+            n_buffers=3,
+            buffers=buffers,
+            release=ctypes.cast(release_arrow, ctypes.c_void_p),
+        )
+        exported[ctypes.addressof(schema)] = schema
+        exported[ctypes.addressof(array)] = array
+        array._keep = (self, buffers)
+        return (
+            capsule_new(ctypes.addressof(schema), b"arrow_schema", destroy_schema),
+            capsule_new(ctypes.addressof(array), b"arrow_array", destroy_array),
+        )
+
+
+Strings = typing.Set[str]
+
+
+@hypothesis.given(
+    keys=hypothesis.infer, others=hypothesis.infer, large=hypothesis.infer
+)
+def test_from_arrow(keys: Strings, others: Strings, large: bool) -> None:
+    others -= keys
+    a = automap.FrozenAutoMap.from_arrow(ArrowStrings([*keys], large))
+    f = automap.FrozenAutoMap(keys)
+    assert type(a) is automap.FrozenAutoMap
+    assert len(exported) == 1
+    assert len(a) == len(keys)
+    assert [*a] == [*keys]
+    assert [*a.items()] == [*f.items()]
+    assert a == f
+    assert hash(a) == hash(f)
+    assert a == pickle.loads(pickle.dumps(a))
+    for index, key in enumerate(keys):
+        assert a[key] == index
+        assert key in a
+    for key in [*others, b"", 0, None, "\ud800"]:
+        assert key not in a
+    queries = automap.FrozenAutoMap.from_arrow(ArrowStrings([*keys, *others], large))
+    expected = [*range(len(keys))] + [-1] * len(others)
+    assert [*a.get_indexer(queries)] == expected
+    assert [*a.get_indexer(automap.FrozenAutoMap([*keys, *others]))] == expected
+    assert [*f.get_indexer(queries)] == expected
+    assert [*(a | automap.FrozenAutoMap(others))] == [*keys, *others]
+    b = automap.AutoMap.from_arrow(ArrowStrings([*keys], large))
+    b |= others
+    assert type(b) is automap.AutoMap
+    assert [*b] == [*keys, *others]
+    del a, queries
+    assert not exported
+    hypothesis.assume(keys)
+    with pytest.raises(automap.NonUniqueError):
+        automap.FrozenAutoMap.from_arrow(ArrowStrings([*keys, *keys], large))
+    assert not exported
+
+
+def test_from_arrow_invalid() -> None:
+    strings = ArrowStrings(["a"])
+    strings.format = b"i"
+    with pytest.raises(TypeError):
+        automap.FrozenAutoMap.from_arrow(strings)
+    with pytest.raises(AttributeError):
+        automap.FrozenAutoMap.from_arrow(["a"])
+    for large in [False, True]:
+        for offsets in [[-1, 1, 2], [0, 2, 1], [0, -(2**31), 2]]:
+            strings = ArrowStrings(["a", "b"], large)
+            strings.offsets[:] = offsets
+            with pytest.raises(ValueError):
+                automap.FrozenAutoMap.from_arrow(strings)
+    assert not exported